@@ -0,0 +1,13 @@
+/**
+ * exec-server-helper.c
+ *
+ * The helper process of a fork server, started by exec_server_start():
+ * spawns the commands sent over the socket it gets as descriptor 3.
+ */
+
+#include "systemcalls.h"
+
+int main(void)
+{
+    exec_server_helper_main();
+}
@@ -0,0 +1,176 @@
+/**
+ * spawn-bench.c
+ *
+ * Latency of starting a program as the parent's memory grows:
+ *
+ *   make bench && ./spawn-bench -m 0,256,1024 -n 200
+ *
+ * For every resident size in -m (MiB, allocated and touched before the
+ * runs), runs -n times /bin/true with fork() + execv() + waitpid(), with
+ * do_exec(), which uses posix_spawn(), and through a fork server, whose
+ * helper program exec-server-helper is looked up next to spawn-bench.
+ * fork() copies the parent's page tables, so its latency grows with the
+ * resident size; posix_spawn() shares the parent's memory until the exec,
+ * and the fork server does not depend on it at all.
+ *
+ * Prints one line of "key=value" pairs per size and method, times in
+ * microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define PROGRAM "/bin/true"
+
+static int iterations = 200;
+static struct exec_server server;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long rss_mb(void)
+{
+    long pages_total, pages_resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    int n = fscanf(f, "%ld %ld", &pages_total, &pages_resident);
+    fclose(f);
+    return n == 2 ? pages_resident * sysconf(_SC_PAGESIZE) / (1024 * 1024) : -1;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static bool fork_exec(void)
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    }
+    if (pid == 0) {
+        char *argv[] = { PROGRAM, NULL };
+        execv(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_exec(void)
+{
+    return do_exec(1, PROGRAM);
+}
+
+static bool server_exec(void)
+{
+    char *argv[] = { PROGRAM, NULL };
+    return exec_server_run(&server, argv, -1, -1, -1) == 0;
+}
+
+static int run_method(const char *name, bool (*run)(void), long long *samples)
+{
+    for (int i = 0; i < iterations; i++) {
+        long long start_ns = now_ns();
+        if (!run()) {
+            fprintf(stderr, "%s failed\n", name);
+            return 1;
+        }
+        samples[i] = now_ns() - start_ns;
+    }
+
+    long long total_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        total_ns += samples[i];
+    }
+    qsort(samples, iterations, sizeof(*samples), compare_ll);
+    printf("rss_mb=%ld method=%s iterations=%d avg_us=%lld p50_us=%lld p99_us=%lld "
+           "max_us=%lld\n", rss_mb(), name, iterations, total_ns / iterations / 1000,
+           samples[iterations / 2] / 1000, samples[(int)((iterations - 1) * 0.99)] / 1000,
+           samples[iterations - 1] / 1000);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m rss_mb,...] [-n iterations]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    char size_list[256] = "0,256,1024";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+        switch (opt) {
+        case 'm': snprintf(size_list, sizeof(size_list), "%s", optarg); break;
+        case 'n': iterations = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long long *samples = malloc(iterations * sizeof(long long));
+    if (samples == NULL) {
+        return 1;
+    }
+    // The helper program sits next to this one
+    const char *slash = strrchr(argv[0], '/');
+    char helper[PATH_MAX];
+    snprintf(helper, sizeof(helper), "%.*s%s", slash ? (int)(slash - argv[0] + 1) : 0, argv[0],
+             EXEC_SERVER_HELPER);
+    if (!exec_server_start(&server, helper)) {
+        fprintf(stderr, "cannot start the fork server %s: %s\n", helper, strerror(errno));
+        return 1;
+    }
+
+    int rc = 0;
+    char *save = NULL;
+    for (char *m = strtok_r(size_list, ",", &save); m; m = strtok_r(NULL, ",", &save)) {
+        size_t bytes = (size_t)atol(m) * 1024 * 1024;
+        char *ballast = NULL;
+        if (bytes > 0) {
+            ballast = malloc(bytes);
+            if (ballast == NULL) {
+                fprintf(stderr, "cannot allocate %s MiB\n", m);
+                rc = 1;
+                break;
+            }
+            // Touch every page so it is resident and mapped
+            memset(ballast, 1, bytes);
+        }
+
+        if (run_method("fork", fork_exec, samples) != 0 ||
+            run_method("posix_spawn", spawn_exec, samples) != 0 ||
+            run_method("fork_server", server_exec, samples) != 0) {
+            rc = 1;
+        }
+        free(ballast);
+    }
+
+    exec_server_stop(&server);
+    free(samples);
+    return rc;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     // pipe2, strchrnul
+ 
 #include "systemcalls.h"
  
 #include <stdlib.h>
@@ -9,9 +11,284 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <time.h>
+ 
+extern char **environ;
+ 
+#define SYSTEM_MAX_ARGS 32          // longer commands go to the shell
+#define SYSTEM_MAX_LEN 1024
+#define PATH_CACHE_SIZE 16
+#define PATH_CACHE_NAME_MAX 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define EXEC_ARGV_INLINE 16         // arguments collected without malloc
+ 
+// Anything the shell would interpret, so the command cannot run without it
+static const char shell_metachars[] = "|&;<>()$`\\\"'*?[]#~=%{}!\n";
+ 
+/**
+ * Programs found in the PATH by previous do_system() calls, valid as long
+ * as PATH does not change.
+ */
+struct path_cache_entry {
+    char name[PATH_CACHE_NAME_MAX];
+    char path[PATH_MAX];
+};
+ 
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+static int path_cache_next;             // entry to replace next
+static char *path_cache_path;           // PATH the entries were found in
+ 
+/**
+ * @return the exit code in wait status @param status, 128 + the signal
+ * number if a signal killed the child, -1 otherwise.
+ */
+static int exit_code(int status)
+{
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return -1;
+}
+ 
+/**
+ * Reap child @param pid, blocking until it exits.
+ * @return its exit code (see exit_code()), or -1 if waitpid() failed.
+ */
+static int wait_child(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+ 
+    return exit_code(status);
+}
+ 
+/**
+ * Find @param name in the directories of @param path, like the shell does.
+ * Returns true with its full path in @param found.
+ */
+static bool path_search(const char *name, const char *path, char found[PATH_MAX])
+{
+    for (const char *dir = path; ; ) {
+        const char *end = strchrnul(dir, ':');
+        int dir_len = end - dir;
+        // An empty entry means the current directory
+        int n = dir_len ? snprintf(found, PATH_MAX, "%.*s/%s", dir_len, dir, name)
+                        : snprintf(found, PATH_MAX, "%s", name);
+        struct stat st;
+        if (n < PATH_MAX && stat(found, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(found, X_OK) == 0) {
+            return true;
+        }
+        if (*end == '\0') {
+            return false;
+        }
+        dir = end + 1;
+    }
+}
+ 
+/**
+ * Resolve @param name through the PATH cache, searching the PATH on a miss.
+ * Returns true with the full path in @param found.
+ */
+static bool path_lookup(const char *name, char found[PATH_MAX])
+{
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = DEFAULT_PATH;
+    }
+    if (strlen(name) >= PATH_CACHE_NAME_MAX) {
+        return path_search(name, path, found);
+    }
+ 
+    pthread_mutex_lock(&path_cache_lock);
+    if (path_cache_path == NULL || strcmp(path_cache_path, path) != 0) {
+        // PATH changed: forget everything found in the old one
+        free(path_cache_path);
+        path_cache_path = strdup(path);
+        memset(path_cache, 0, sizeof(path_cache));
+    }
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        if (strcmp(path_cache[i].name, name) == 0) {
+            memcpy(found, path_cache[i].path, PATH_MAX);
+            pthread_mutex_unlock(&path_cache_lock);
+            return true;
+        }
+    }
+    bool ok = path_search(name, path, found);
+    if (ok && path_cache_path != NULL) {
+        struct path_cache_entry *entry = &path_cache[path_cache_next];
+        path_cache_next = (path_cache_next + 1) % PATH_CACHE_SIZE;
+        strcpy(entry->name, name);
+        memcpy(entry->path, found, PATH_MAX);
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+    return ok;
+}
+ 
+/**
+ * Drop @param name from the PATH cache, after running it failed.
+ */
+static void path_forget(const char *name)
+{
+    pthread_mutex_lock(&path_cache_lock);
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        if (strcmp(path_cache[i].name, name) == 0) {
+            path_cache[i].name[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+}
+ 
+/**
+ * system() ignores SIGINT and SIGQUIT while its child runs and blocks
+ * SIGCHLD in the waiting thread, so Ctrl-C only reaches the child and a
+ * SIGCHLD handler of the caller cannot reap it first.  The dispositions
+ * are shared by the process, so concurrent callers count themselves in and
+ * the last one out restores them, as glibc does.
+ */
+static pthread_mutex_t system_signal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int system_signal_users;
+static struct sigaction system_saved_int;
+static struct sigaction system_saved_quit;
+ 
+/**
+ * Set up the signal handling of system() for one child, saving the signal
+ * mask of the calling thread in @param old_mask.  @param child_default
+ * gets the signals the child must reset to their default action: SIGINT
+ * and SIGQUIT, unless the caller ignored them already.
+ */
+static void system_signals_enter(sigset_t *old_mask, sigset_t *child_default)
+{
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, old_mask);
+ 
+    pthread_mutex_lock(&system_signal_lock);
+    if (system_signal_users++ == 0) {
+        struct sigaction ignore = { .sa_handler = SIG_IGN };
+        sigemptyset(&ignore.sa_mask);
+        sigaction(SIGINT, &ignore, &system_saved_int);
+        sigaction(SIGQUIT, &ignore, &system_saved_quit);
+    }
+    sigemptyset(child_default);
+    if (system_saved_int.sa_handler != SIG_IGN) {
+        sigaddset(child_default, SIGINT);
+    }
+    if (system_saved_quit.sa_handler != SIG_IGN) {
+        sigaddset(child_default, SIGQUIT);
+    }
+    pthread_mutex_unlock(&system_signal_lock);
+}
+ 
+/**
+ * Undo system_signals_enter(), restoring the signal mask @param old_mask.
+ */
+static void system_signals_leave(const sigset_t *old_mask)
+{
+    pthread_mutex_lock(&system_signal_lock);
+    if (--system_signal_users == 0) {
+        sigaction(SIGINT, &system_saved_int, NULL);
+        sigaction(SIGQUIT, &system_saved_quit, NULL);
+    }
+    pthread_mutex_unlock(&system_signal_lock);
+    pthread_sigmask(SIG_SETMASK, old_mask, NULL);
+}
+ 
+/**
+ * Run @param cmd without /bin/sh if it is a plain list of words: no shell
+ * syntax (see shell_metachars), a program found in the PATH (so not a
+ * shell builtin like cd), at most SYSTEM_MAX_ARGS words.  Signals are
+ * handled like system() does, see system_signals_enter().
+ *
+ * @return 1 if it ran and exited with status 0, 0 if it ran and failed,
+ * -1 if it needs the shell.
+ */
+static int system_without_shell(const char *cmd)
+{
+    size_t len = strlen(cmd);
+    if (len >= SYSTEM_MAX_LEN || strpbrk(cmd, shell_metachars) != NULL) {
+        return -1;
+    }
+ 
+    // Split on blanks, in a copy
+    char words[SYSTEM_MAX_LEN];
+    char *argv[SYSTEM_MAX_ARGS + 1];
+    int argc = 0;
+    memcpy(words, cmd, len + 1);
+    char *save = NULL;
+    for (char *w = strtok_r(words, " \t", &save); w != NULL; w = strtok_r(NULL, " \t", &save)) {
+        if (argc == SYSTEM_MAX_ARGS) {
+            return -1;
+        }
+        argv[argc++] = w;
+    }
+    if (argc == 0) {
+        return -1;
+    }
+    argv[argc] = NULL;
+ 
+    char program[PATH_MAX];
+    if (strchr(argv[0], '/') != NULL) {
+        if (access(argv[0], X_OK) != 0) {
+            return -1;
+        }
+        snprintf(program, sizeof(program), "%s", argv[0]);
+    } else if (!path_lookup(argv[0], program)) {
+        return -1;
+    }
+ 
+    sigset_t old_mask, child_default;
+    system_signals_enter(&old_mask, &child_default);
+ 
+    // The child starts with the caller's mask and default SIGINT/SIGQUIT
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &child_default);
+    posix_spawnattr_setsigmask(&attr, &old_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+ 
+    pid_t pid;
+    int result;
+    if (posix_spawn(&pid, program, NULL, &attr, argv, environ) != 0) {
+        // Removed or replaced since it was cached: let the shell sort it out
+        path_forget(argv[0]);
+        result = -1;
+    } else {
+        result = wait_child(pid) == 0 ? 1 : 0;
+    }
+ 
+    posix_spawnattr_destroy(&attr);
+    system_signals_leave(&old_mask);
+    return result;
+}
  
 /**
  * @param cmd the command to execute with system()
+ * Commands without shell syntax are run directly (see
+ * system_without_shell()), saving the start of /bin/sh, with the same
+ * signal handling as system().
  * @return true if the command in @param cmd was executed
  * successfully using the system() call, false if an error occurred,
  * either in invocation of the system() call, or if a non-zero return
@@ -23,6 +300,12 @@ bool do_system(const char *cmd)
         return false;
     }
  
+    // Simple commands do not need a shell in between
+    int fast = system_without_shell(cmd);
+    if (fast >= 0) {
+        return fast == 1;
+    }
+ 
     int status = system(cmd);
  
     if (status == -1) {
@@ -38,6 +321,62 @@ bool do_system(const char *cmd)
     return false;
 }
  
+/**
+ * Run @param argv (argv[0] being the full path of the program) with the
+ * file actions in @param actions, if not NULL, and wait for it.
+ *
+ * posix_spawn() starts the child with vfork semantics (CLONE_VM |
+ * CLONE_VFORK in glibc), so unlike fork() it does not copy the page tables
+ * of the parent, whose cost grows with the parent's memory.  glibc also
+ * reports a failing exec through the return value.
+ *
+ * @return true if the child exited with status 0.
+ */
+static bool spawn_and_wait(char *const argv[], const posix_spawn_file_actions_t *actions)
+{
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], actions, NULL, argv, environ) != 0) {
+        // spawn or exec failed
+        return false;
+    }
+ 
+    return wait_child(pid) == 0;
+}
+ 
+/**
+ * Collect the @param count command arguments in @param args into a NULL
+ * terminated argv: in @param inline_argv when they fit, which covers
+ * almost every call without touching the heap, or in a heap array, so a
+ * long argument list cannot overflow the stack.
+ * @return the argv, or NULL if @param count < 1 or out of memory.
+ */
+static char **argv_collect(int count, va_list args, char *inline_argv[EXEC_ARGV_INLINE + 1])
+{
+    if (count < 1) {
+        return NULL;
+    }
+ 
+    char **argv = inline_argv;
+    if (count > EXEC_ARGV_INLINE) {
+        argv = malloc((count + 1) * sizeof(char *));
+        if (argv == NULL) {
+            return NULL;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        argv[i] = va_arg(args, char *);
+    }
+    argv[count] = NULL;
+    return argv;
+}
+ 
+static void argv_release(char **argv, char *inline_argv[])
+{
+    if (argv != inline_argv) {
+        free(argv);
+    }
+}
+ 
 /**
  * @param count -The numbers of variables passed to the function. The variables are command to execute.
  * followed by arguments to pass to the command
@@ -60,107 +399,1277 @@ bool do_exec(int count, ...)
     va_start(args, count);
  
     // +1 for NULL terminator required by execv
-    char *command[count + 1];
+    char *inline_command[EXEC_ARGV_INLINE + 1];
+    char **command = argv_collect(count, args, inline_command);
  
-    for (int i = 0; i < count; i++) {
-        command[i] = va_arg(args, char *);
+    va_end(args);
+ 
+    bool ok = command != NULL && do_execv(command);
+    argv_release(command, inline_command);
+    return ok;
+}
+ 
+/**
+ * Same as do_exec(), with the command and its arguments in the NULL
+ * terminated array @param argv, which is used as is.
+ */
+bool do_execv(char *const argv[])
+{
+    if (argv == NULL || argv[0] == NULL) {
+        return false;
     }
-    command[count] = NULL;
+ 
+    return spawn_and_wait(argv, NULL);
+}
+ 
+/**
+ * Like do_exec(), but redirects stdout of the executed program
+ * to the file specified in @param outputfile.
+ *
+ * @param outputfile - path to the file to which stdout should be redirected
+ * @param count, ... - same semantics as do_exec()
+ *
+ * @return true on successful execution (child exits with status 0),
+ * false on any error (open, spawn, dup2, waitpid, or non-zero exit).
+ */
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+ 
+    char *inline_command[EXEC_ARGV_INLINE + 1];
+    char **command = argv_collect(count, args, inline_command);
  
     va_end(args);
  
-    pid_t pid = fork();
-    if (pid == -1) {
-        // fork failed
+    bool ok = command != NULL && do_execv_redirect(outputfile, command);
+    argv_release(command, inline_command);
+    return ok;
+}
+ 
+/**
+ * Same as do_exec_redirect(), with the command and its arguments in the
+ * NULL terminated array @param argv.
+ */
+bool do_execv_redirect(const char *outputfile, char *const argv[])
+{
+    if (outputfile == NULL || argv == NULL || argv[0] == NULL) {
+        return false;
+    }
+ 
+    // Open (or create) the output file
+    int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+ 
+    // Child: redirect stdout to the file (dup2 clears O_CLOEXEC on the copy)
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        close(fd);
+        return false;
+    }
+    bool ok = posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO) == 0 &&
+              spawn_and_wait(argv, &actions);
+ 
+    // Parent: no longer need this fd
+    posix_spawn_file_actions_destroy(&actions);
+    close(fd);
+    return ok;
+}
+ 
+/**
+ * Open a pidfd for child @param pid: a file descriptor that becomes
+ * readable when the child exits (Linux 5.3 and later).
+ * @return the descriptor, or -1 if the kernel does not support it.
+ */
+static int pidfd_open_child(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+ 
+/**
+ * Start @param argv like do_exec(), without waiting for it.
+ *
+ * @return true if the child was started; @param handle then holds its pid
+ * and pidfd, and must be passed to exec_finish().
+ */
+bool exec_start(struct exec_handle *handle, char *const argv[])
+{
+    if (handle == NULL || argv == NULL || argv[0] == NULL) {
+        return false;
+    }
+ 
+    if (posix_spawn(&handle->pid, argv[0], NULL, NULL, argv, environ) != 0) {
+        return false;
+    }
+    handle->pidfd = pidfd_open_child(handle->pid);
+    return true;
+}
+ 
+/**
+ * Wait for the child of @param handle, reap it and close its pidfd.
+ *
+ * @return its exit code, 128 + the signal number if a signal killed it,
+ * or -1 on error.
+ */
+int exec_finish(struct exec_handle *handle)
+{
+    int status = wait_child(handle->pid);
+    if (handle->pidfd >= 0) {
+        close(handle->pidfd);
+        handle->pidfd = -1;
+    }
+    return status;
+}
+ 
+/**
+ * Run the commands of @param items, at most @param max_parallel at a time,
+ * waiting for all of them in one epoll loop over their pidfds.  Without
+ * pidfd support each command is waited for before the next one starts.
+ *
+ * @return the number of commands that exited with status 0, or -1 if the
+ * epoll instance could not be created.
+ */
+int do_exec_batch(struct exec_batch_item *items, size_t count, int max_parallel)
+{
+    if (items == NULL || max_parallel < 1) {
+        return -1;
+    }
+ 
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        return -1;
+    }
+ 
+    struct exec_handle *handles = malloc(count * sizeof(struct exec_handle));
+    if (handles == NULL && count > 0) {
+        close(epfd);
+        return -1;
+    }
+ 
+    size_t next = 0;
+    int running = 0;
+    int succeeded = 0;
+    while (next < count || running > 0) {
+        // 1) Start commands up to the concurrency limit
+        while (next < count && running < max_parallel) {
+            size_t i = next++;
+            items[i].status = -1;
+            handles[i].pidfd = -1;
+            if (!exec_start(&handles[i], items[i].argv)) {
+                continue;
+            }
+ 
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = i };
+            if (handles[i].pidfd < 0 ||
+                epoll_ctl(epfd, EPOLL_CTL_ADD, handles[i].pidfd, &ev) != 0) {
+                // Cannot be watched: wait for it right away
+                items[i].status = exec_finish(&handles[i]);
+                succeeded += items[i].status == 0;
+                continue;
+            }
+            running++;
+        }
+        if (running == 0) {
+            continue;
+        }
+ 
+        // 2) Reap whichever commands exited
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            size_t i = events[e].data.u64;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, handles[i].pidfd, NULL);
+            items[i].status = exec_finish(&handles[i]);
+            succeeded += items[i].status == 0;
+            running--;
+        }
+    }
+ 
+    // Only reached with children left if epoll_wait() failed: do not leak them
+    for (size_t i = 0; i < next && running > 0; i++) {
+        if (items[i].status == -1 && handles[i].pidfd >= 0) {
+            items[i].status = exec_finish(&handles[i]);
+            succeeded += items[i].status == 0;
+            running--;
+        }
+    }
+ 
+    free(handles);
+    close(epfd);
+    return succeeded;
+}
+ 
+/**
+ * Run the @param count commands in @param argvs as a pipeline, like
+ * "cmd1 | cmd2 | cmd3" in a shell but without starting one: the stdout of
+ * every command is connected to the stdin of the next by a pipe.  The
+ * stdout of the last one goes to @param outputfile (created or
+ * truncated), or stays the caller's if it is NULL.
+ *
+ * The commands write to each other directly through the pipes, so no data
+ * passes through this process.
+ *
+ * @param statuses - if not NULL, receives the exit code of every command
+ * (128 + signal number if killed, -1 if it could not be started).
+ *
+ * @return true if every command exited with status 0 (like "set -o
+ * pipefail", so a command killed by SIGPIPE because a later one stopped
+ * reading counts as a failure), false otherwise.
+ */
+bool do_exec_pipeline(char *const *const argvs[], size_t count, const char *outputfile,
+                      int statuses[])
+{
+    if (argvs == NULL || count == 0) {
+        return false;
+    }
+ 
+    pid_t *pids = malloc(count * sizeof(pid_t));
+    if (pids == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pids[i] = -1;
+    }
+ 
+    int out_fd = -1;
+    if (outputfile != NULL) {
+        out_fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            free(pids);
+            return false;
+        }
+    }
+ 
+    // Read end of the pipe from the previous command, -1 for the first one
+    int in_fd = -1;
+    for (size_t i = 0; i < count; i++) {
+        int pipe_fds[2] = { -1, -1 };
+        bool last = i == count - 1;
+        if (!last && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            // Start no more commands; the previous one gets EPIPE
+            break;
+        }
+        int stage_out = last ? out_fd : pipe_fds[1];
+ 
+        // Only the dup2 copies survive the exec, every pipe end is O_CLOEXEC
+        posix_spawn_file_actions_t actions;
+        if (posix_spawn_file_actions_init(&actions) == 0) {
+            if ((in_fd < 0 ||
+                 posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO) == 0) &&
+                (stage_out < 0 ||
+                 posix_spawn_file_actions_adddup2(&actions, stage_out, STDOUT_FILENO) == 0) &&
+                argvs[i] != NULL && argvs[i][0] != NULL &&
+                posix_spawn(&pids[i], argvs[i][0], &actions, NULL, argvs[i], environ) != 0) {
+                pids[i] = -1;
+            }
+            posix_spawn_file_actions_destroy(&actions);
+        }
+ 
+        // The parent keeps no pipe ends, so EOF and EPIPE reach the commands
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] >= 0) {
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+ 
+    bool ok = true;
+    for (size_t i = 0; i < count; i++) {
+        int status = pids[i] > 0 ? wait_child(pids[i]) : -1;
+        if (statuses != NULL) {
+            statuses[i] = status;
+        }
+        ok = ok && status == 0;
+    }
+ 
+    free(pids);
+    return ok;
+}
+ 
+/**
+ * Growable buffer of one captured stream.
+ */
+struct capture_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+ 
+/**
+ * Append @param len bytes of @param chunk to @param buf, keeping at most
+ * @param max_bytes in it.  Returns false if it had to drop bytes.
+ */
+static bool capture_append(struct capture_buf *buf, const char *chunk, size_t len,
+                           size_t max_bytes)
+{
+    size_t room = max_bytes - buf->len;
+    size_t keep = len < room ? len : room;
+    if (keep == 0) {
+        return len == 0;
+    }
+ 
+    // Geometric growth, plus one byte for the terminating NUL
+    if (buf->len + keep + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + keep + 1) {
+            cap *= 2;
+        }
+        char *data = realloc(buf->data, cap);
+        if (data == NULL) {
+            return false;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, chunk, keep);
+    buf->len += keep;
+    buf->data[buf->len] = '\0';
+    return keep == len;
+}
+ 
+/**
+ * Run @param argv (argv[0] being the full path of the program) and collect
+ * its stdout and stderr in memory, without temporary files: both are
+ * pipes read concurrently in a poll() loop, so the child never blocks on a
+ * full pipe whichever stream it writes.
+ *
+ * @param max_bytes - at most this many bytes of each stream are kept in
+ * @param capture; the rest is still read, and passed to the callback, but
+ * dropped (capture->truncated is set).  0 keeps nothing.
+ * @param callback - if not NULL, called with every chunk as it arrives,
+ * with STDOUT_FILENO or STDERR_FILENO as @param fd.
+ * @param capture - receives the NUL terminated output (NULL for an empty
+ * stream) and the exit code; release it with exec_capture_free().
+ *
+ * @return true if the command exited with status 0.
+ */
+bool do_exec_capture(char *const argv[], size_t max_bytes, exec_output_callback callback,
+                     void *callback_arg, struct exec_capture *capture)
+{
+    if (argv == NULL || argv[0] == NULL || capture == NULL) {
+        return false;
+    }
+    memset(capture, 0, sizeof(*capture));
+    capture->status = -1;
+ 
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        return false;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
+    }
+ 
+    pid_t pid = -1;
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) == 0) {
+        if (posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO) != 0 ||
+            posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO) != 0 ||
+            posix_spawn(&pid, argv[0], &actions, NULL, argv, environ) != 0) {
+            pid = -1;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+ 
+    // Only the child may hold the write ends, so we see EOF when it exits
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (pid < 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
         return false;
     }
  
-    if (pid == 0) {
-        // Child: replace image with requested program
-        execv(command[0], command);
+    struct pollfd fds[2] = {
+        { .fd = out_pipe[0], .events = POLLIN },
+        { .fd = err_pipe[0], .events = POLLIN },
+    };
+    struct capture_buf bufs[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    const int stream_fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    int open_streams = 2;
+    char chunk[4096];
+ 
+    while (open_streams > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // EOF (or a read error): this stream is done
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_streams--;
+                continue;
+            }
+            if (callback != NULL) {
+                callback(stream_fds[i], chunk, n, callback_arg);
+            }
+            if (!capture_append(&bufs[i], chunk, n, max_bytes)) {
+                capture->truncated = true;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+ 
+    capture->out = bufs[0].data;
+    capture->out_len = bufs[0].len;
+    capture->err = bufs[1].data;
+    capture->err_len = bufs[1].len;
+    capture->status = wait_child(pid);
+    return capture->status == 0;
+}
+ 
+/**
+ * Free the output buffers of @param capture.
+ */
+void exec_capture_free(struct exec_capture *capture)
+{
+    free(capture->out);
+    free(capture->err);
+    capture->out = NULL;
+    capture->err = NULL;
+    capture->out_len = 0;
+    capture->err_len = 0;
+}
+ 
+#define EXEC_SERVER_MAX_MSG (64 * 1024)
+#define EXEC_SERVER_FDS 3                   // stdin, stdout, stderr
+#define EXEC_SERVER_SOCK_FD 3               // the helper's socket, below all others
+ 
+/**
+ * Request to the fork server: argc NUL terminated strings follow, and a
+ * descriptor for every bit of fd_mask (bit n for fd n) rides along as
+ * SCM_RIGHTS, in order.
+ */
+struct exec_server_request {
+    uint32_t id;
+    uint32_t argc;
+    uint32_t fd_mask;
+};
+ 
+/**
+ * Reply of the fork server once the command of request @param id is done:
+ * its exit code (see exit_code()), or -1 if it could not be spawned.
+ */
+struct exec_server_reply {
+    uint32_t id;
+    int32_t status;
+};
+ 
+/**
+ * Caller of exec_server_run() waiting for the reply to its request, on the
+ * list of its exec_server.  Lives on the caller's stack.
+ */
+struct exec_server_waiter {
+    uint32_t id;
+    int32_t status;
+    bool done;
+    struct exec_server_waiter *next;
+};
+ 
+/**
+ * Command the fork server is running, until its exit status is sent.
+ */
+struct exec_server_child {
+    pid_t pid;
+    uint32_t id;
+};
+ 
+/**
+ * Receive one request from @param sock into @param buf, with the
+ * descriptors that came with it in @param fds (-1 for none).
+ * Returns the length of the message, 0 on EOF, -1 on error.
+ */
+static ssize_t exec_server_recv(int sock, char *buf, size_t size, int fds[EXEC_SERVER_FDS])
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(EXEC_SERVER_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+ 
+    for (int i = 0; i < EXEC_SERVER_FDS; i++) {
+        fds[i] = -1;
+    }
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+ 
+    const struct exec_server_request *req = (const struct exec_server_request *)buf;
+    int received[EXEC_SERVER_FDS];
+    int nreceived = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (nreceived < EXEC_SERVER_FDS) {
+                    received[nreceived++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    for (int i = 0, next = 0; i < EXEC_SERVER_FDS && (size_t)n >= sizeof(*req); i++) {
+        if ((req->fd_mask & (1u << i)) && next < nreceived) {
+            fds[i] = received[next++];
+        }
+    }
+    return n;
+}
+ 
+/**
+ * Tell the caller that request @param id ended with @param status.  A
+ * caller that went away is not an error: the helper goes on reaping.
+ */
+static void exec_server_reply(int sock, uint32_t id, int32_t status)
+{
+    struct exec_server_reply reply = { .id = id, .status = status };
+    while (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == -1 && errno == EINTR) {
+    }
+}
+ 
+/**
+ * Spawn the command of the request of @param n bytes in @param buf, with
+ * the descriptors in @param fds as its stdin, stdout and stderr, and a
+ * clean signal mask (the helper blocks SIGCHLD).
+ * @return its pid, or -1 if the request is malformed or spawning failed.
+ */
+static pid_t exec_server_spawn(char *buf, ssize_t n, const int fds[EXEC_SERVER_FDS], char **argv)
+{
+    // 1) Unpack argv, checking it stays inside the message
+    const struct exec_server_request *req = (const struct exec_server_request *)buf;
+    size_t argc = 0;
+    if ((size_t)n < sizeof(*req) || req->argc == 0) {
+        return -1;
+    }
+    char *p = buf + sizeof(*req);
+    char *end = buf + n;
+    while (argc < req->argc && p < end) {
+        char *nul = memchr(p, '\0', end - p);
+        if (nul == NULL) {
+            break;
+        }
+        argv[argc++] = p;
+        p = nul + 1;
+    }
+    if (argc != req->argc) {
+        return -1;
+    }
+    argv[argc] = NULL;
+ 
+    // 2) Spawn it with the caller's descriptors
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return -1;
+    }
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    bool ok = posix_spawnattr_setsigmask(&attr, &none) == 0 &&
+              posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK) == 0;
+    for (int i = 0; i < EXEC_SERVER_FDS; i++) {
+        if (fds[i] >= 0) {
+            ok = ok && posix_spawn_file_actions_adddup2(&actions, fds[i], i) == 0;
+        }
+    }
+    pid_t pid;
+    if (!ok || posix_spawn(&pid, argv[0], &actions, &attr, argv, environ) != 0) {
+        pid = -1;
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+ 
+/**
+ * Close every descriptor from @param first up, with close_range() where
+ * the C library and kernel have it (glibc 2.34, Linux 5.9) and one by one
+ * otherwise.
+ */
+static void close_fds_from(int first)
+{
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (unsigned int)first, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    for (long fd = first; fd < (max > 0 ? max : 1024); fd++) {
+        close(fd);
+    }
+}
  
-        // If execv returns, it failed
+/**
+ * Body of the fork server process: spawn every requested command with the
+ * descriptors it came with, and reply with the exit code of each as soon
+ * as it exits, so commands of several callers run at the same time.
+ * Children are reaped through a signalfd for SIGCHLD.  Once the socket is
+ * closed the helper exits after its last child.
+ */
+static void exec_server_main(int sock)
+{
+    char *buf = malloc(EXEC_SERVER_MAX_MSG);
+    char **argv = malloc((EXEC_SERVER_MAX_MSG / 2 + 1) * sizeof(char *));
+    struct exec_server_child *children = NULL;
+    size_t nchildren = 0, children_cap = 0;
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sigfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (buf == NULL || argv == NULL || sigfd == -1) {
         _exit(EXIT_FAILURE);
     }
  
-    // Parent: wait for child
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
+    bool open = true;
+    while (open || nchildren > 0) {
+        struct pollfd pfds[2] = {
+            { .fd = sigfd, .events = POLLIN },
+            { .fd = open ? sock : -1, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(EXIT_FAILURE);
+        }
+ 
+        // 1) Report the commands that exited
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            int wstatus;
+            pid_t pid;
+            while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                for (size_t i = 0; i < nchildren; i++) {
+                    if (children[i].pid == pid) {
+                        exec_server_reply(sock, children[i].id, exit_code(wstatus));
+                        children[i] = children[--nchildren];
+                        break;
+                    }
+                }
+            }
+        }
+ 
+        // 2) Start the next command
+        if (open && pfds[1].revents != 0) {
+            int fds[EXEC_SERVER_FDS];
+            ssize_t n = exec_server_recv(sock, buf, EXEC_SERVER_MAX_MSG, fds);
+            if (n <= 0) {
+                open = false;
+                continue;
+            }
+            const struct exec_server_request *req = (const struct exec_server_request *)buf;
+            uint32_t id = (size_t)n >= sizeof(*req) ? req->id : 0;
+ 
+            if (nchildren == children_cap) {
+                size_t cap = children_cap ? children_cap * 2 : 16;
+                struct exec_server_child *grown = realloc(children, cap * sizeof(*children));
+                if (grown != NULL) {
+                    children = grown;
+                    children_cap = cap;
+                }
+            }
+            pid_t pid = nchildren < children_cap ? exec_server_spawn(buf, n, fds, argv) : -1;
+            for (int i = 0; i < EXEC_SERVER_FDS; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+            if (pid == -1) {
+                exec_server_reply(sock, id, -1);
+            } else {
+                children[nchildren].pid = pid;
+                children[nchildren].id = id;
+                nchildren++;
+            }
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+ 
+/**
+ * main() of the fork server helper program, exec-server-helper.c: serve
+ * the socket exec_server_start() passed as descriptor EXEC_SERVER_SOCK_FD.
+ * Does not return.
+ */
+void exec_server_helper_main(void)
+{
+    // Keep nothing of the caller's but stdin, stdout and stderr, so pipes
+    // it has open without O_CLOEXEC still see EOF when it closes its ends
+    close_fds_from(EXEC_SERVER_SOCK_FD + 1);
+    exec_server_main(EXEC_SERVER_SOCK_FD);
+}
+ 
+/**
+ * Start a fork server: the helper program @param helper (the path of
+ * exec-server-helper, which the Makefile builds next to spawn-bench)
+ * spawns commands on behalf of this process, see exec_server_run().  The
+ * helper itself is started with posix_spawn(), so this is safe in a
+ * multithreaded process and the helper shares none of its memory:
+ * spawning through it costs the same however much memory this process
+ * maps.  The helper keeps only its socket and stdin, stdout and stderr
+ * open, and starts with an empty signal mask and default signal actions.
+ *
+ * @return true if the helper was started, false with errno set otherwise.
+ */
+bool exec_server_start(struct exec_server *server, const char *helper)
+{
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) != 0) {
         return false;
     }
+    if (socks[1] == EXEC_SERVER_SOCK_FD) {
+        // dup2() onto itself would leave O_CLOEXEC set
+        int fd = fcntl(socks[1], F_DUPFD_CLOEXEC, EXEC_SERVER_SOCK_FD + 1);
+        close(socks[1]);
+        socks[1] = fd;
+        if (fd == -1) {
+            close(socks[0]);
+            return false;
+        }
+    }
  
-    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
-        return true;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc == 0 && (rc = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    pid_t pid = -1;
+    if (rc == 0) {
+        sigset_t all, none;
+        sigfillset(&all);
+        sigemptyset(&none);
+        char *argv[] = { (char *)helper, NULL };
+        if ((rc = posix_spawn_file_actions_adddup2(&actions, socks[1],
+                                                   EXEC_SERVER_SOCK_FD)) == 0 &&
+            (rc = posix_spawnattr_setsigdefault(&attr, &all)) == 0 &&
+            (rc = posix_spawnattr_setsigmask(&attr, &none)) == 0 &&
+            (rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                                  POSIX_SPAWN_SETSIGMASK)) == 0) {
+            rc = posix_spawn(&pid, helper, &actions, &attr, argv, environ);
+        }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(socks[1]);
+    if (rc != 0) {
+        close(socks[0]);
+        errno = rc;
+        return false;
     }
  
-    return false;
+    server->pid = pid;
+    server->sock = socks[0];
+    server->next_id = 0;
+    server->reading = false;
+    server->broken = false;
+    server->waiters = NULL;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+    return true;
 }
  
 /**
- * Like do_exec(), but redirects stdout of the executed program
- * to the file specified in @param outputfile.
+ * Wait for the reply to the request of @param waiter, which is on the list
+ * of @param server; server->lock is held.  One waiter at a time reads the
+ * socket, without the lock, and hands every reply to the waiter it is for.
+ */
+static void exec_server_wait(struct exec_server *server, struct exec_server_waiter *waiter)
+{
+    while (!waiter->done) {
+        if (server->reading) {
+            pthread_cond_wait(&server->cond, &server->lock);
+            continue;
+        }
+ 
+        server->reading = true;
+        pthread_mutex_unlock(&server->lock);
+        struct exec_server_reply reply;
+        ssize_t n;
+        do {
+            n = recv(server->sock, &reply, sizeof(reply), 0);
+        } while (n < 0 && errno == EINTR);
+        pthread_mutex_lock(&server->lock);
+        server->reading = false;
+ 
+        if (n != sizeof(reply)) {
+            // The helper is gone: no reply will come for anybody
+            server->broken = true;
+        }
+        for (struct exec_server_waiter *w = server->waiters; w != NULL; w = w->next) {
+            if (server->broken && !w->done) {
+                w->status = -1;
+                w->done = true;
+            } else if (!server->broken && w->id == reply.id) {
+                w->status = reply.status;
+                w->done = true;
+                break;
+            }
+        }
+        pthread_cond_broadcast(&server->cond);
+    }
+}
+ 
+/**
+ * Run @param argv (argv[0] being the full path of the program) through the
+ * fork server @param server and wait for it.  The command gets
+ * @param in_fd, @param out_fd and @param err_fd as its stdin, stdout and
+ * stderr, or the helper's own (those of this process when it was started)
+ * where they are -1.  Every request carries an id and the helper replies
+ * when its command exits, so commands of several threads run at the same
+ * time; the lock is only held to send the request and to sort replies.
  *
- * @param outputfile - path to the file to which stdout should be redirected
- * @param count, ... - same semantics as do_exec()
+ * @return the exit code of the command (128 + signal number if killed),
+ * or -1 if it could not be run.
+ */
+int exec_server_run(struct exec_server *server, char *const argv[], int in_fd, int out_fd,
+                    int err_fd)
+{
+    if (server == NULL || argv == NULL || argv[0] == NULL) {
+        return -1;
+    }
+ 
+    // 1) Pack the request
+    char *buf = malloc(EXEC_SERVER_MAX_MSG);
+    if (buf == NULL) {
+        return -1;
+    }
+    struct exec_server_request *req = (struct exec_server_request *)buf;
+    size_t len = sizeof(*req);
+    req->argc = 0;
+    req->fd_mask = 0;
+    for (; argv[req->argc] != NULL; req->argc++) {
+        size_t arg_len = strlen(argv[req->argc]) + 1;
+        if (len + arg_len > EXEC_SERVER_MAX_MSG) {
+            free(buf);
+            return -1;
+        }
+        memcpy(buf + len, argv[req->argc], arg_len);
+        len += arg_len;
+    }
+ 
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(EXEC_SERVER_FDS * sizeof(int))];
+    } control;
+    const int fds[EXEC_SERVER_FDS] = { in_fd, out_fd, err_fd };
+    int nfds = 0;
+    int sent[EXEC_SERVER_FDS];
+    for (int i = 0; i < EXEC_SERVER_FDS; i++) {
+        if (fds[i] >= 0) {
+            req->fd_mask |= 1u << i;
+            sent[nfds++] = fds[i];
+        }
+    }
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), sent, nfds * sizeof(int));
+    }
+ 
+    // 2) Send it under a fresh id and wait for the reply with that id
+    struct exec_server_waiter waiter = { .status = -1 };
+    pthread_mutex_lock(&server->lock);
+    if (!server->broken) {
+        waiter.id = req->id = server->next_id++;
+        ssize_t n;
+        do {
+            n = sendmsg(server->sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n == (ssize_t)len) {
+            waiter.next = server->waiters;
+            server->waiters = &waiter;
+            exec_server_wait(server, &waiter);
+            struct exec_server_waiter **link = &server->waiters;
+            while (*link != &waiter) {
+                link = &(*link)->next;
+            }
+            *link = waiter.next;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+ 
+    free(buf);
+    return waiter.status;
+}
+ 
+/**
+ * Stop the fork server @param server and reap it.  No exec_server_run()
+ * call may be in progress.
+ */
+void exec_server_stop(struct exec_server *server)
+{
+    // EOF on its socket makes the helper exit
+    close(server->sock);
+    wait_child(server->pid);
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->lock);
+}
+ 
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+ 
+/**
+ * Wait up to @param timeout_ms milliseconds for child @param pid to exit,
+ * without reaping it, so wait4() can still collect its resource usage.
+ * @return true if it exited in time.
+ */
+static bool wait_exit(pid_t pid, int timeout_ms)
+{
+    long long deadline_ms = monotonic_ms() + timeout_ms;
+ 
+    int pidfd = pidfd_open_child(pid);
+    if (pidfd >= 0) {
+        struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+        int n;
+        do {
+            long long left_ms = deadline_ms - monotonic_ms();
+            n = poll(&pfd, 1, left_ms > 0 ? (int)left_ms : 0);
+        } while (n < 0 && errno == EINTR);
+        close(pidfd);
+        return n > 0;
+    }
+ 
+    // No pidfd: look at the child every millisecond
+    for (;;) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0) {
+            return true;
+        }
+        if (monotonic_ms() >= deadline_ms) {
+            return false;
+        }
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+ 
+/**
+ * Run @param argv like spawn_and_wait(), and kill it with SIGKILL if it
+ * is still running after @param timeout_ms milliseconds (no limit if
+ * negative).  With a limit the command runs in a process group of its
+ * own, so the whole group (the command and anything it started) is
+ * killed; that group is in the background, so a command reading from the
+ * terminal stops with SIGTTIN and terminal signals such as Ctrl-C do not
+ * reach it.  Without a limit it stays in the caller's group.  The child
+ * is reaped with wait4() to fill @param result with its resource usage.
  *
- * @return true on successful execution (child exits with status 0),
- * false on any error (open, fork, dup2, waitpid, or non-zero exit).
+ * @return true if the child exited with status 0 in time.
  */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+static bool spawn_and_wait_limited(char *const argv[], const posix_spawn_file_actions_t *actions,
+                                   int timeout_ms, struct exec_result *result)
 {
-    if (outputfile == NULL) {
+    memset(result, 0, sizeof(*result));
+    result->status = -1;
+ 
+    posix_spawnattr_t attr;
+    if (posix_spawnattr_init(&attr) != 0) {
+        return false;
+    }
+    pid_t pid;
+    int rc = 0;
+    if (timeout_ms >= 0) {
+        rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        if (rc == 0) {
+            rc = posix_spawnattr_setpgroup(&attr, 0);
+        }
+    }
+    if (rc == 0) {
+        rc = posix_spawn(&pid, argv[0], actions, &attr, argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0) {
         return false;
     }
  
+    if (timeout_ms >= 0 && !wait_exit(pid, timeout_ms)) {
+        result->timed_out = true;
+        // The child leads its group, whose id is its pid
+        killpg(pid, SIGKILL);
+    }
+ 
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    result->status = exit_code(status);
+    result->user_time = usage.ru_utime;
+    result->system_time = usage.ru_stime;
+    result->max_rss_kb = usage.ru_maxrss;
+    return result->status == 0 && !result->timed_out;
+}
+ 
+/**
+ * Like do_exec(), but kill the command and its process group if it runs
+ * longer than @param timeout_ms milliseconds (no limit if negative).  With
+ * a limit, the command runs in a background process group of its own: it
+ * cannot read from the terminal and does not get Ctrl-C.
+ *
+ * @param result - if not NULL, receives the exit code, whether the
+ * command timed out, and its CPU time and peak resident size.
+ *
+ * @return true if the command exited with status 0 before the timeout.
+ */
+bool do_exec_timeout(int timeout_ms, struct exec_result *result, int count, ...)
+{
     va_list args;
     va_start(args, count);
  
-    char *command[count + 1];
+    char *inline_command[EXEC_ARGV_INLINE + 1];
+    char **command = argv_collect(count, args, inline_command);
  
-    for (int i = 0; i < count; i++) {
-        command[i] = va_arg(args, char *);
+    va_end(args);
+ 
+    bool ok = command != NULL && do_execv_timeout(timeout_ms, result, command);
+    argv_release(command, inline_command);
+    return ok;
+}
+ 
+/**
+ * Same as do_exec_timeout(), with the command and its arguments in the
+ * NULL terminated array @param argv.
+ */
+bool do_execv_timeout(int timeout_ms, struct exec_result *result, char *const argv[])
+{
+    if (argv == NULL || argv[0] == NULL) {
+        return false;
     }
-    command[count] = NULL;
+ 
+    struct exec_result local;
+    return spawn_and_wait_limited(argv, NULL, timeout_ms, result ? result : &local);
+}
+ 
+/**
+ * Like do_exec_redirect(), with the timeout and @param result of
+ * do_exec_timeout().
+ */
+bool do_exec_redirect_timeout(const char *outputfile, int timeout_ms, struct exec_result *result,
+                              int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+ 
+    char *inline_command[EXEC_ARGV_INLINE + 1];
+    char **command = argv_collect(count, args, inline_command);
  
     va_end(args);
  
-    // Open (or create) the output file
-    int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = command != NULL &&
+              do_execv_redirect_timeout(outputfile, timeout_ms, result, command);
+    argv_release(command, inline_command);
+    return ok;
+}
+ 
+/**
+ * Same as do_exec_redirect_timeout(), with the command and its arguments
+ * in the NULL terminated array @param argv.
+ */
+bool do_execv_redirect_timeout(const char *outputfile, int timeout_ms,
+                               struct exec_result *result, char *const argv[])
+{
+    if (outputfile == NULL || argv == NULL || argv[0] == NULL) {
+        return false;
+    }
+ 
+    int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
     if (fd < 0) {
         return false;
     }
  
-    pid_t pid = fork();
-    if (pid == -1) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
         close(fd);
         return false;
     }
+    struct exec_result local;
+    bool ok = posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO) == 0 &&
+              spawn_and_wait_limited(argv, &actions, timeout_ms, result ? result : &local);
  
-    if (pid == 0) {
-        // Child: redirect stdout to the file
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-            _exit(EXIT_FAILURE);
-        }
-        close(fd);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fd);
+    return ok;
+}
  
-        // Execute the requested program
-        execv(command[0], command);
+/**
+ * A command prepared once by exec_command_prepare(): the resolved program
+ * path, argv and environment, with their strings, in one allocation.
+ */
+struct exec_command {
+    const char *path;
+    char **argv;
+    char **envp;                        // NULL for the caller's environment at run time
+};
  
-        // If execv returns, it failed
-        _exit(EXIT_FAILURE);
+/**
+ * Bytes needed to copy the NULL terminated string array @param strings
+ * (pointers and strings), and the number of strings in @param count.
+ */
+static size_t strings_size(char *const strings[], size_t *count)
+{
+    size_t size = sizeof(char *);
+    for (*count = 0; strings[*count] != NULL; (*count)++) {
+        size += sizeof(char *) + strlen(strings[*count]) + 1;
     }
+    return size;
+}
  
-    // Parent: no longer need this fd
-    close(fd);
+/**
+ * Copy @param count strings of @param strings into @param array and the
+ * string area at @param *area, advancing it.
+ */
+static void strings_copy(char **array, char *const strings[], size_t count, char **area)
+{
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(strings[i]) + 1;
+        memcpy(*area, strings[i], len);
+        array[i] = *area;
+        *area += len;
+    }
+    array[count] = NULL;
+}
  
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        return false;
+/**
+ * Prepare @param argv for running many times with exec_command_run(), so
+ * every run only spawns and waits: the arguments are copied, a program
+ * name without a '/' is looked up in the PATH now, and @param envp, if not
+ * NULL, is copied as the environment of every run (NULL runs with the
+ * environment current at each run).
+ *
+ * @return the command, to be released with exec_command_free(), or NULL
+ * if the program was not found or out of memory.
+ */
+struct exec_command *exec_command_prepare(char *const argv[], char *const envp[])
+{
+    if (argv == NULL || argv[0] == NULL) {
+        return NULL;
     }
  
-    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
-        return true;
+    char path[PATH_MAX];
+    if (strchr(argv[0], '/') != NULL) {
+        if (snprintf(path, sizeof(path), "%s", argv[0]) >= (int)sizeof(path)) {
+            return NULL;
+        }
+    } else if (!path_lookup(argv[0], path)) {
+        return NULL;
     }
  
-    return false;
+    size_t argc, envc = 0;
+    size_t size = sizeof(struct exec_command) + strlen(path) + 1 + strings_size(argv, &argc);
+    if (envp != NULL) {
+        size += strings_size(envp, &envc);
+    }
+ 
+    // Pointer arrays first, for their alignment, then the strings
+    struct exec_command *cmd = malloc(size);
+    if (cmd == NULL) {
+        return NULL;
+    }
+    cmd->argv = (char **)(cmd + 1);
+    cmd->envp = envp != NULL ? cmd->argv + argc + 1 : NULL;
+    char *area = (char *)(cmd->argv + argc + 1 + (envp != NULL ? envc + 1 : 0));
+ 
+    size_t path_len = strlen(path) + 1;
+    memcpy(area, path, path_len);
+    cmd->path = area;
+    area += path_len;
+    strings_copy(cmd->argv, argv, argc, &area);
+    if (envp != NULL) {
+        strings_copy(cmd->envp, envp, envc, &area);
+    }
+    return cmd;
+}
+ 
+/**
+ * Run the prepared command @param cmd and wait for it.
+ *
+ * @return its exit code (128 + signal number if killed), or -1 if it could
+ * not be started.
+ */
+int exec_command_run(const struct exec_command *cmd)
+{
+    pid_t pid;
+    if (cmd == NULL ||
+        posix_spawn(&pid, cmd->path, NULL, NULL, cmd->argv,
+                    cmd->envp != NULL ? cmd->envp : environ) != 0) {
+        return -1;
+    }
+    return wait_child(pid);
+}
+ 
+void exec_command_free(struct exec_command *cmd)
+{
+    free(cmd);
 }
@@ -1,9 +1,127 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+bool do_execv(char *const argv[]);
+
+bool do_execv_redirect(const char *outputfile, char *const argv[]);
+
+/**
+ * A command started with exec_start(): its pid, and a pidfd that becomes readable when it
+ * exits, usable with poll() or epoll (-1 if the kernel has no pidfd support).
+ */
+struct exec_handle {
+    pid_t pid;
+    int pidfd;
+};
+
+bool exec_start(struct exec_handle *handle, char *const argv[]);
+
+int exec_finish(struct exec_handle *handle);
+
+/**
+ * One command of do_exec_batch(): a NULL terminated argv with the full path of the program
+ * first, and its result, the exit code (128 + signal number if killed, -1 if it could not be
+ * started or waited for).
+ */
+struct exec_batch_item {
+    char *const *argv;
+    int status;
+};
+
+int do_exec_batch(struct exec_batch_item *items, size_t count, int max_parallel);
+
+bool do_exec_pipeline(char *const *const argvs[], size_t count, const char *outputfile,
+                      int statuses[]);
+
+/**
+ * Output of a command run by do_exec_capture(): its stdout and stderr, NUL terminated (NULL if
+ * empty), whether bytes beyond the size limit were dropped, and its exit code (as in
+ * exec_batch_item).
+ */
+struct exec_capture {
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    bool truncated;
+    int status;
+};
+
+typedef void (*exec_output_callback)(int fd, const char *data, size_t len, void *arg);
+
+bool do_exec_capture(char *const argv[], size_t max_bytes, exec_output_callback callback,
+                     void *callback_arg, struct exec_capture *capture);
+
+void exec_capture_free(struct exec_capture *capture);
+
+/**
+ * A fork server started with exec_server_start(): the helper process, the socket to it, and
+ * the callers of exec_server_run() waiting for their commands.
+ */
+struct exec_server {
+    pid_t pid;
+    int sock;
+    pthread_mutex_t lock;               // guards the fields below
+    pthread_cond_t cond;                // a reply was handed out, or the reader left
+    uint32_t next_id;                   // id of the next request
+    bool reading;                       // a waiter is receiving replies
+    bool broken;                        // the helper is gone
+    struct exec_server_waiter *waiters;
+};
+
+// Fork server helper program, built by the Makefile from exec-server-helper.c
+#define EXEC_SERVER_HELPER "exec-server-helper"
+
+bool exec_server_start(struct exec_server *server, const char *helper);
+
+int exec_server_run(struct exec_server *server, char *const argv[], int in_fd, int out_fd,
+                    int err_fd);
+
+void exec_server_stop(struct exec_server *server);
+
+void exec_server_helper_main(void);
+
+/**
+ * How a command run by do_exec_timeout() or do_exec_redirect_timeout() went: its exit code
+ * (as in exec_batch_item), whether it was killed for running too long, and its resource usage.
+ */
+struct exec_result {
+    int status;
+    bool timed_out;
+    struct timeval user_time;
+    struct timeval system_time;
+    long max_rss_kb;
+};
+
+bool do_exec_timeout(int timeout_ms, struct exec_result *result, int count, ...);
+
+bool do_exec_redirect_timeout(const char *outputfile, int timeout_ms, struct exec_result *result,
+                              int count, ...);
+
+bool do_execv_timeout(int timeout_ms, struct exec_result *result, char *const argv[]);
+
+bool do_execv_redirect_timeout(const char *outputfile, int timeout_ms,
+                               struct exec_result *result, char *const argv[]);
+
+/**
+ * A command prepared with exec_command_prepare() for repeated runs.
+ */
+struct exec_command;
+
+struct exec_command *exec_command_prepare(char *const argv[], char *const envp[]);
+
+int exec_command_run(const struct exec_command *cmd);
+
+void exec_command_free(struct exec_command *cmd);
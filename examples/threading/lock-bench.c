@@ -0,0 +1,374 @@
+/**
+ * lock-bench.c
+ *
+ * Throughput of the lock types of the threading library under contention:
+ *
+ *   make bench && ./lock-bench -k pthread,mcs -t 1,4,16,64 -H both
+ *
+ * For every lock type, thread count and hold time, the threads lock, run
+ * the critical section, unlock and do a little work outside the lock until
+ * -d milliseconds are up.  The short critical section only increments a
+ * shared counter; the long one also busy-waits -L nanoseconds.
+ *
+ * Prints one line of "key=value" pairs per case: throughput, the longest
+ * wait for the lock, Jain's fairness index of the per-thread operation
+ * counts (1.0 when all threads got the lock equally often) and, where
+ * perf_event_open() is allowed, the cache misses per operation as a
+ * measure of cache-line traffic.  The shared counter is checked against
+ * the number of acquisitions, so a lock that fails to exclude shows up as
+ * an error.  The lockprof kind is a profiled pthread_mutex_t; its report
+ * follows the line of each of its cases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "threading.h"
+#include "locks.h"
+#include "lockprof.h"
+
+#define CACHE_LINE 64
+#define MAX_THREADS 1024
+
+struct lock_kind {
+    const char *name;
+    const struct thread_lock_ops *ops;
+    size_t size;
+    int (*init)(void *lock);
+    void (*destroy)(void *lock);    // NULL if the lock needs no teardown
+};
+
+static int init_pthread(void *lock)
+{
+    return pthread_mutex_init((pthread_mutex_t *)lock, NULL);
+}
+
+static void destroy_pthread(void *lock)
+{
+    pthread_mutex_destroy((pthread_mutex_t *)lock);
+}
+
+static int init_spinpark(void *lock)
+{
+    spinpark_mutex_init((struct spinpark_mutex *)lock);
+    return 0;
+}
+
+static int init_lockprof(void *lock)
+{
+    return lockprof_mutex_init((struct lockprof_mutex *)lock, "lock-bench");
+}
+
+static void destroy_lockprof(void *lock)
+{
+    lockprof_mutex_destroy((struct lockprof_mutex *)lock);
+}
+
+static int init_ticket(void *lock)
+{
+    ticket_lock_init((struct ticket_lock *)lock);
+    return 0;
+}
+
+static int init_mcs(void *lock)
+{
+    mcs_lock_init((struct mcs_lock *)lock);
+    return 0;
+}
+
+static const struct lock_kind kinds[] = {
+    { "pthread",  &thread_lock_pthread_mutex, sizeof(pthread_mutex_t),       init_pthread,
+      destroy_pthread },
+    { "spinpark", &spinpark_lock_ops,         sizeof(struct spinpark_mutex), init_spinpark,
+      NULL },
+    { "lockprof", &lockprof_lock_ops,         sizeof(struct lockprof_mutex), init_lockprof,
+      destroy_lockprof },
+    { "ticket",   &ticket_lock_ops,           sizeof(struct ticket_lock),    init_ticket,
+      NULL },
+    { "mcs",      &mcs_lock_ops,              sizeof(struct mcs_lock),       init_mcs,
+      NULL },
+};
+#define NKINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+static int duration_ms = 200;
+static long long long_hold_ns = 2000;
+
+struct worker {
+    pthread_t thread;
+    unsigned long ops;
+    long long max_wait_ns;
+    char pad[CACHE_LINE];       // keep the counters of workers apart
+};
+
+struct bench_case {
+    const struct lock_kind *kind;
+    void *lock;
+    long long hold_ns;          // busy wait inside the lock, 0 for short
+    unsigned long counter;      // protected by lock
+    atomic_int stop;
+    pthread_barrier_t start;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void busy_wait_ns(long long ns)
+{
+    long long end = now_ns() + ns;
+    while (now_ns() < end) {
+    }
+}
+
+struct worker_arg {
+    struct bench_case *bc;
+    struct worker *w;
+};
+
+static void *worker_main(void *arg)
+{
+    struct bench_case *bc = ((struct worker_arg *)arg)->bc;
+    struct worker *w = ((struct worker_arg *)arg)->w;
+    const struct thread_lock_ops *ops = bc->kind->ops;
+    unsigned long ops_done = 0;
+    long long max_wait_ns = 0;
+    volatile unsigned int outside = 0;
+
+    pthread_barrier_wait(&bc->start);
+    while (!atomic_load_explicit(&bc->stop, memory_order_relaxed)) {
+        long long wait_start = now_ns();
+        ops->lock(bc->lock);
+        long long wait_ns = now_ns() - wait_start;
+        if (wait_ns > max_wait_ns) {
+            max_wait_ns = wait_ns;
+        }
+        bc->counter++;
+        if (bc->hold_ns) {
+            busy_wait_ns(bc->hold_ns);
+        }
+        ops->unlock(bc->lock);
+        ops_done++;
+
+        // A little work outside the lock
+        for (int i = 0; i < 32; i++) {
+            outside += i;
+        }
+    }
+    w->ops = ops_done;
+    w->max_wait_ns = max_wait_ns;
+    return NULL;
+}
+
+/**
+ * Start counting cache misses of the calling thread and the threads it
+ * creates from now on.
+ * Returns the counter fd, or -1 if perf events are not available.
+ */
+static int cache_miss_counter_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Read the counter @param fd once the threads that inherited it exited,
+ * and close it.  Returns -1 on error.
+ */
+static long long cache_miss_counter_close(int fd)
+{
+    long long count = -1;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = -1;
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * Run one case and print its line.
+ * Returns 0 on success, -1 on error.
+ */
+static int run_case(const struct lock_kind *kind, int nthreads, long long hold_ns)
+{
+    struct bench_case bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.kind = kind;
+    bc.hold_ns = hold_ns;
+    size_t lock_size = (kind->size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    bc.lock = aligned_alloc(CACHE_LINE, lock_size);
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    struct worker_arg *args = calloc(nthreads, sizeof(*args));
+    if (!bc.lock || !workers || !args || kind->init(bc.lock) != 0) {
+        fprintf(stderr, "cannot set up %s lock\n", kind->name);
+        free(bc.lock);
+        free(workers);
+        free(args);
+        return -1;
+    }
+    pthread_barrier_init(&bc.start, NULL, nthreads + 1);
+    int misses_fd = cache_miss_counter_open();
+
+    int started = 0;
+    for (; started < nthreads; started++) {
+        args[started].bc = &bc;
+        args[started].w = &workers[started];
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &args[started]) != 0) {
+            break;
+        }
+    }
+    if (started < nthreads) {
+        // Cannot go on with fewer threads than the barrier expects
+        fprintf(stderr, "pthread_create failed after %d threads\n", started);
+        exit(1);
+    }
+
+    pthread_barrier_wait(&bc.start);
+    long long start = now_ns();
+    struct timespec ts = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+    atomic_store(&bc.stop, 1);
+
+    unsigned long total = 0, min_ops = (unsigned long)-1, max_ops = 0;
+    long long max_wait_ns = 0;
+    double sum_squares = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].ops;
+        sum_squares += (double)workers[i].ops * workers[i].ops;
+        if (workers[i].max_wait_ns > max_wait_ns) {
+            max_wait_ns = workers[i].max_wait_ns;
+        }
+        if (workers[i].ops < min_ops) {
+            min_ops = workers[i].ops;
+        }
+        if (workers[i].ops > max_ops) {
+            max_ops = workers[i].ops;
+        }
+    }
+    long long elapsed = now_ns() - start;
+    long long misses = misses_fd != -1 ? cache_miss_counter_close(misses_fd) : -1;
+
+    int rc = 0;
+    printf("lock=%s threads=%d hold=%s ops=%lu ops_per_sec=%.0f "
+           "min_thread_ops=%lu max_thread_ops=%lu max_wait_us=%.1f fairness=%.3f",
+           kind->name, nthreads, hold_ns ? "long" : "short", total,
+           total / (elapsed / 1e9), min_ops, max_ops, max_wait_ns / 1e3,
+           sum_squares > 0 ? (double)total * total / (nthreads * sum_squares) : 0.0);
+    if (misses >= 0 && total > 0) {
+        printf(" cache_misses_per_op=%.2f", (double)misses / total);
+    } else {
+        printf(" cache_misses_per_op=na");
+    }
+    if (bc.counter != total) {
+        printf(" error=counter_mismatch counter=%lu", bc.counter);
+        rc = -1;
+    }
+    printf("\n");
+    if (kind->ops == &lockprof_lock_ops) {
+        // The profile slot of the lock is reused by the next case
+        lockprof_report(stdout);
+    }
+    fflush(stdout);
+
+    pthread_barrier_destroy(&bc.start);
+    if (kind->destroy) {
+        kind->destroy(bc.lock);
+    }
+    free(bc.lock);
+    free(workers);
+    free(args);
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-k kind,...] [-t threads,...] [-H short|long|both]\n"
+            "          [-d duration_ms] [-L long_hold_ns]\n"
+            "Kinds:", prog);
+    for (size_t i = 0; i < NKINDS; i++) {
+        fprintf(stderr, " %s", kinds[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char kind_list[256] = "pthread,spinpark,ticket,mcs";
+    char thread_list[256] = "1,2,4,8,16,32,64";
+    const char *holds = "both";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "k:t:H:d:L:")) != -1) {
+        switch (opt) {
+        case 'k': snprintf(kind_list, sizeof(kind_list), "%s", optarg); break;
+        case 't': snprintf(thread_list, sizeof(thread_list), "%s", optarg); break;
+        case 'H': holds = optarg; break;
+        case 'd': duration_ms = atoi(optarg); break;
+        case 'L': long_hold_ns = atoll(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    int do_short = strcmp(holds, "short") == 0 || strcmp(holds, "both") == 0;
+    int do_long = strcmp(holds, "long") == 0 || strcmp(holds, "both") == 0;
+    if ((!do_short && !do_long) || duration_ms <= 0 || long_hold_ns <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int rc = 0;
+    char *kind_save = NULL;
+    for (char *k = strtok_r(kind_list, ",", &kind_save); k;
+         k = strtok_r(NULL, ",", &kind_save)) {
+        const struct lock_kind *kind = NULL;
+        for (size_t i = 0; i < NKINDS; i++) {
+            if (strcmp(kinds[i].name, k) == 0) {
+                kind = &kinds[i];
+            }
+        }
+        if (!kind) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        char threads_copy[256];
+        snprintf(threads_copy, sizeof(threads_copy), "%s", thread_list);
+        char *thread_save = NULL;
+        for (char *t = strtok_r(threads_copy, ",", &thread_save); t;
+             t = strtok_r(NULL, ",", &thread_save)) {
+            int nthreads = atoi(t);
+            if (nthreads < 1 || nthreads > MAX_THREADS) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (do_short && run_case(kind, nthreads, 0) != 0) {
+                rc = 1;
+            }
+            if (do_long && run_case(kind, nthreads, long_hold_ns) != 0) {
+                rc = 1;
+            }
+        }
+    }
+
+    return rc;
+}
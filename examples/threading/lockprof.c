@@ -0,0 +1,282 @@
+/**
+ * lockprof.c
+ *
+ * Mutex contention profiler, see lockprof.h.
+ */
+
+#include "lockprof.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/**
+ * What one thread recorded for one mutex.
+ */
+struct lockprof_stats {
+    unsigned long acquisitions;
+    unsigned long contended;            // found locked by another thread
+    unsigned long acquire_hist[LOCKPROF_BUCKETS];
+    unsigned long hold_hist[LOCKPROF_BUCKETS];
+    long long acquire_max_ns;
+    long long hold_max_ns;
+};
+
+/**
+ * Statistics of one thread, allocated when it first locks a profiled
+ * mutex and kept after it exits so its numbers stay in the report.
+ */
+struct lockprof_thread {
+    int index;                          // threads are numbered in order of first use
+    struct lockprof_stats *stats[LOCKPROF_MAX_MUTEXES];
+    struct lockprof_thread *next;
+};
+
+/**
+ * Guards the thread list and the mutex slots.  A slot is in use from
+ * lockprof_mutex_init() to lockprof_mutex_destroy(); a destroyed slot
+ * keeps its name and statistics until a new mutex takes it over.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lockprof_thread *threads = NULL;
+static int thread_count = 0;
+static const char *names[LOCKPROF_MAX_MUTEXES];
+static int mutex_count = 0;                         // slots ever used
+static int free_slots[LOCKPROF_MAX_MUTEXES];        // destroyed slots, reused first
+static int free_count = 0;
+
+static __thread struct lockprof_thread *self = NULL;
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket_of(long long ns)
+{
+    int bucket = 0;
+    while (ns > 1 && bucket < LOCKPROF_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * Statistics of the calling thread for mutex @param id, allocated on
+ * first use.  Returns NULL if out of memory.
+ */
+static struct lockprof_stats *thread_stats(int id)
+{
+    if (self == NULL) {
+        struct lockprof_thread *t = calloc(1, sizeof(*t));
+        if (t == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&registry_lock);
+        t->index = thread_count++;
+        t->next = threads;
+        threads = t;
+        pthread_mutex_unlock(&registry_lock);
+        self = t;
+    }
+
+    if (self->stats[id] == NULL) {
+        self->stats[id] = calloc(1, sizeof(struct lockprof_stats));
+    }
+    return self->stats[id];
+}
+
+int lockprof_mutex_init(struct lockprof_mutex *lp, const char *name)
+{
+    if (pthread_mutex_init(&lp->mutex, NULL) != 0) {
+        return -1;
+    }
+
+    int id;
+    pthread_mutex_lock(&registry_lock);
+    if (free_count > 0) {
+        // Nothing locks a destroyed mutex, so its statistics are ours to drop
+        id = free_slots[--free_count];
+        for (struct lockprof_thread *t = threads; t != NULL; t = t->next) {
+            free(t->stats[id]);
+            t->stats[id] = NULL;
+        }
+    } else if (mutex_count < LOCKPROF_MAX_MUTEXES) {
+        id = mutex_count++;
+    } else {
+        pthread_mutex_unlock(&registry_lock);
+        pthread_mutex_destroy(&lp->mutex);
+        return -1;
+    }
+    names[id] = name;
+    pthread_mutex_unlock(&registry_lock);
+
+    lp->id = id;
+    lp->obtained_ns = 0;
+    return 0;
+}
+
+int lockprof_mutex_destroy(struct lockprof_mutex *lp)
+{
+    int rc = pthread_mutex_destroy(&lp->mutex);
+    if (rc == 0) {
+        pthread_mutex_lock(&registry_lock);
+        free_slots[free_count++] = lp->id;
+        pthread_mutex_unlock(&registry_lock);
+    }
+    return rc;
+}
+
+int lockprof_lock(struct lockprof_mutex *lp)
+{
+    struct lockprof_stats *stats = thread_stats(lp->id);
+    if (stats == NULL) {
+        return ENOMEM;
+    }
+
+    long long start_ns = monotonic_ns();
+    int rc = pthread_mutex_trylock(&lp->mutex);
+    if (rc == EBUSY) {
+        stats->contended++;
+        rc = pthread_mutex_lock(&lp->mutex);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    long long now_ns = monotonic_ns();
+    long long acquire_ns = now_ns - start_ns;
+    stats->acquisitions++;
+    stats->acquire_hist[bucket_of(acquire_ns)]++;
+    if (acquire_ns > stats->acquire_max_ns) {
+        stats->acquire_max_ns = acquire_ns;
+    }
+    lp->obtained_ns = now_ns;
+    return 0;
+}
+
+int lockprof_unlock(struct lockprof_mutex *lp)
+{
+    // The owner locked it, so its statistics exist already
+    struct lockprof_stats *stats = self ? self->stats[lp->id] : NULL;
+    long long hold_ns = monotonic_ns() - lp->obtained_ns;
+
+    int rc = pthread_mutex_unlock(&lp->mutex);
+    if (rc == 0 && stats != NULL) {
+        stats->hold_hist[bucket_of(hold_ns)]++;
+        if (hold_ns > stats->hold_max_ns) {
+            stats->hold_max_ns = hold_ns;
+        }
+    }
+    return rc;
+}
+
+static int lockprof_op_lock(void *lock)
+{
+    return lockprof_lock((struct lockprof_mutex *)lock);
+}
+
+static int lockprof_op_unlock(void *lock)
+{
+    return lockprof_unlock((struct lockprof_mutex *)lock);
+}
+
+const struct thread_lock_ops lockprof_lock_ops = {
+    .name   = "lockprof",
+    .lock   = lockprof_op_lock,
+    .unlock = lockprof_op_unlock,
+};
+
+/**
+ * Upper bound in nanoseconds of the bucket of @param hist holding the
+ * @param percent percentile of @param count samples.
+ */
+static long long hist_percentile(const unsigned long *hist, unsigned long count, int percent)
+{
+    unsigned long rank = (count * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (int k = 0; k < LOCKPROF_BUCKETS; k++) {
+        seen += hist[k];
+        if (seen >= rank && seen > 0) {
+            return 2LL << k;
+        }
+    }
+    return 0;
+}
+
+static void print_hist(FILE *out, const char *what, const unsigned long *hist)
+{
+    fprintf(out, "  %s histogram (ns):", what);
+    for (int k = 0; k < LOCKPROF_BUCKETS; k++) {
+        if (hist[k] != 0) {
+            fprintf(out, " [%lld,%lld):%lu", 1LL << k, 2LL << k, hist[k]);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+void lockprof_report(FILE *out)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (int id = 0; id < mutex_count; id++) {
+        struct lockprof_stats total;
+        memset(&total, 0, sizeof(total));
+        int nthreads = 0;
+
+        for (struct lockprof_thread *t = threads; t != NULL; t = t->next) {
+            const struct lockprof_stats *s = t->stats[id];
+            if (s == NULL) {
+                continue;
+            }
+            nthreads++;
+            total.acquisitions += s->acquisitions;
+            total.contended += s->contended;
+            for (int k = 0; k < LOCKPROF_BUCKETS; k++) {
+                total.acquire_hist[k] += s->acquire_hist[k];
+                total.hold_hist[k] += s->hold_hist[k];
+            }
+            if (s->acquire_max_ns > total.acquire_max_ns) {
+                total.acquire_max_ns = s->acquire_max_ns;
+            }
+            if (s->hold_max_ns > total.hold_max_ns) {
+                total.hold_max_ns = s->hold_max_ns;
+            }
+        }
+
+        unsigned long holds = 0;
+        for (int k = 0; k < LOCKPROF_BUCKETS; k++) {
+            holds += total.hold_hist[k];
+        }
+
+        fprintf(out, "mutex \"%s\": %lu acquisitions by %d threads, %lu contended (%.1f%%)\n",
+                names[id], total.acquisitions, nthreads, total.contended,
+                total.acquisitions ? 100.0 * total.contended / total.acquisitions : 0.0);
+        if (total.acquisitions == 0) {
+            continue;
+        }
+        fprintf(out, "  acquire ns: p50<%lld p99<%lld max=%lld\n",
+                hist_percentile(total.acquire_hist, total.acquisitions, 50),
+                hist_percentile(total.acquire_hist, total.acquisitions, 99),
+                total.acquire_max_ns);
+        fprintf(out, "  hold ns: p50<%lld p99<%lld max=%lld\n",
+                hist_percentile(total.hold_hist, holds, 50),
+                hist_percentile(total.hold_hist, holds, 99),
+                total.hold_max_ns);
+        print_hist(out, "acquire", total.acquire_hist);
+        print_hist(out, "hold", total.hold_hist);
+
+        for (struct lockprof_thread *t = threads; t != NULL; t = t->next) {
+            const struct lockprof_stats *s = t->stats[id];
+            if (s != NULL) {
+                fprintf(out, "  thread %d: %lu acquisitions, %lu contended, "
+                        "acquire max=%lld ns, hold max=%lld ns\n", t->index,
+                        s->acquisitions, s->contended, s->acquire_max_ns, s->hold_max_ns);
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,69 @@
+/**
+ * lockprof.h
+ *
+ * Contention profiler for mutexes: a pthread_mutex_t wrapper that records,
+ * per mutex and per thread, how long each acquisition took, how long the
+ * mutex was then held and how often it was found already locked.  Times go
+ * into log2 histograms kept by each thread, so recording takes no shared
+ * lock; lockprof_report() merges them.
+ *
+ * A profiled mutex can be handed to the delayed lock operations with
+ * start_thread_obtaining_lock(thread, &lockprof_lock_ops, &lp, ...).
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "threading.h"
+
+#define LOCKPROF_MAX_MUTEXES 64
+#define LOCKPROF_BUCKETS 40     // bucket k counts times in [2^k, 2^(k+1)) ns
+
+struct lockprof_mutex {
+    pthread_mutex_t mutex;
+    int id;                     // index of the mutex in the profile
+    long long obtained_ns;      // when the current owner obtained it
+};
+
+/**
+ * Initialize @param lp and add it to the profile under @param name, which
+ * must stay valid until the last report.  The statistics of a mutex stay
+ * in the profile after it is destroyed, until a mutex initialized later
+ * takes over its slot.
+ * Returns 0 on success, -1 if LOCKPROF_MAX_MUTEXES mutexes are already
+ * live or the mutex could not be initialized.
+ */
+int lockprof_mutex_init(struct lockprof_mutex *lp, const char *name);
+
+/**
+ * Destroy the mutex of @param lp and release its slot in the profile.
+ * Returns the result of pthread_mutex_destroy().
+ */
+int lockprof_mutex_destroy(struct lockprof_mutex *lp);
+
+/**
+ * Lock and unlock @param lp, recording the acquisition and hold times.
+ * Return the result of pthread_mutex_lock() and pthread_mutex_unlock(),
+ * or ENOMEM if the statistics of the calling thread could not be allocated.
+ */
+int lockprof_lock(struct lockprof_mutex *lp);
+int lockprof_unlock(struct lockprof_mutex *lp);
+
+/**
+ * Operations for a struct lockprof_mutex, see struct thread_lock_ops.
+ */
+extern const struct thread_lock_ops lockprof_lock_ops;
+
+/**
+ * Write the merged statistics of every profiled mutex to @param out: counts,
+ * acquisition and hold time percentiles and histograms, and a line per
+ * thread.  The counters of running threads are read without
+ * synchronization, so a report is only exact once the profiled threads
+ * are quiescent.
+ */
+void lockprof_report(FILE *out);
+
+#endif /* LOCKPROF_H */
@@ -0,0 +1,254 @@
+/**
+ * locks.c
+ *
+ * Alternative lock types for the threading library, see locks.h.
+ */
+
+#include "locks.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SPINPARK_BACKOFF_MAX 64
+
+/**
+ * Tell the CPU we are busy waiting (saves power, yields to an SMT sibling).
+ */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void futex_wait(atomic_int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int *addr, int nwake)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwake, NULL, NULL, 0);
+}
+
+void spinpark_mutex_init(struct spinpark_mutex *m)
+{
+    atomic_init(&m->state, 0);
+    atomic_init(&m->spin_limit, SPINPARK_SPIN_MIN * 4);
+}
+
+int spinpark_lock(struct spinpark_mutex *m)
+{
+    int c = 0;
+    if (atomic_compare_exchange_strong_explicit(&m->state, &c, 1, memory_order_acquire,
+                                                memory_order_relaxed)) {
+        return 0;
+    }
+
+    // Spin, only reading the lock word until it looks free
+    int limit = atomic_load_explicit(&m->spin_limit, memory_order_relaxed);
+    int spins = 0;
+    for (int backoff = 1; spins < limit; ) {
+        for (int i = 0; i < backoff; i++) {
+            cpu_relax();
+        }
+        spins += backoff;
+        if (backoff < SPINPARK_BACKOFF_MAX) {
+            backoff *= 2;
+        }
+
+        c = 0;
+        if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(&m->state, &c, 1, memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            // Aim for twice the spinning this acquisition needed
+            int target = 2 * spins;
+            if (target < SPINPARK_SPIN_MIN) {
+                target = SPINPARK_SPIN_MIN;
+            } else if (target > SPINPARK_SPIN_MAX) {
+                target = SPINPARK_SPIN_MAX;
+            }
+            atomic_store_explicit(&m->spin_limit, limit + (target - limit) / 8,
+                                  memory_order_relaxed);
+            return 0;
+        }
+    }
+
+    // Spinning did not pay off: spin less next time, and park
+    if (limit > SPINPARK_SPIN_MIN) {
+        atomic_store_explicit(&m->spin_limit, limit - (limit - SPINPARK_SPIN_MIN) / 4,
+                              memory_order_relaxed);
+    }
+    c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+    while (c != 0) {
+        futex_wait(&m->state, 2);
+        c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+    }
+    return 0;
+}
+
+int spinpark_unlock(struct spinpark_mutex *m)
+{
+    if (atomic_fetch_sub_explicit(&m->state, 1, memory_order_release) != 1) {
+        // There may be sleepers: release fully and wake one
+        atomic_store_explicit(&m->state, 0, memory_order_release);
+        futex_wake(&m->state, 1);
+    }
+    return 0;
+}
+
+static int spinpark_op_lock(void *lock)
+{
+    return spinpark_lock((struct spinpark_mutex *)lock);
+}
+
+static int spinpark_op_unlock(void *lock)
+{
+    return spinpark_unlock((struct spinpark_mutex *)lock);
+}
+
+const struct thread_lock_ops spinpark_lock_ops = {
+    .name   = "spinpark",
+    .lock   = spinpark_op_lock,
+    .unlock = spinpark_op_unlock,
+};
+
+/**
+ * Spin step @param spins of a queue lock waiter.
+ */
+static void queue_lock_wait(unsigned int spins)
+{
+    if (spins % QUEUE_LOCK_SPINS_BEFORE_YIELD == QUEUE_LOCK_SPINS_BEFORE_YIELD - 1) {
+        // The lock holder or the next in line may be waiting for our CPU
+        sched_yield();
+    } else {
+        cpu_relax();
+    }
+}
+
+void ticket_lock_init(struct ticket_lock *l)
+{
+    atomic_init(&l->next, 0);
+    atomic_init(&l->owner, 0);
+}
+
+int ticket_lock(struct ticket_lock *l)
+{
+    unsigned int ticket = atomic_fetch_add_explicit(&l->next, 1, memory_order_relaxed);
+    for (unsigned int spins = 0;
+         atomic_load_explicit(&l->owner, memory_order_acquire) != ticket; spins++) {
+        queue_lock_wait(spins);
+    }
+    return 0;
+}
+
+int ticket_unlock(struct ticket_lock *l)
+{
+    // Only the owner writes owner
+    unsigned int owner = atomic_load_explicit(&l->owner, memory_order_relaxed);
+    atomic_store_explicit(&l->owner, owner + 1, memory_order_release);
+    return 0;
+}
+
+static int ticket_op_lock(void *lock)
+{
+    return ticket_lock((struct ticket_lock *)lock);
+}
+
+static int ticket_op_unlock(void *lock)
+{
+    return ticket_unlock((struct ticket_lock *)lock);
+}
+
+const struct thread_lock_ops ticket_lock_ops = {
+    .name   = "ticket",
+    .lock   = ticket_op_lock,
+    .unlock = ticket_op_unlock,
+};
+
+// Queue nodes of the calling thread, one per MCS lock it holds
+static __thread struct mcs_node mcs_nodes[MCS_MAX_NESTING];
+static __thread bool mcs_node_used[MCS_MAX_NESTING];
+
+void mcs_lock_init(struct mcs_lock *l)
+{
+    atomic_init(&l->tail, NULL);
+    l->holder = NULL;
+}
+
+int mcs_lock(struct mcs_lock *l)
+{
+    int slot = 0;
+    while (slot < MCS_MAX_NESTING && mcs_node_used[slot]) {
+        slot++;
+    }
+    if (slot == MCS_MAX_NESTING) {
+        return EAGAIN;
+    }
+    mcs_node_used[slot] = true;
+
+    struct mcs_node *node = &mcs_nodes[slot];
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->waiting, 1, memory_order_relaxed);
+
+    struct mcs_node *prev = atomic_exchange_explicit(&l->tail, node, memory_order_acq_rel);
+    if (prev != NULL) {
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+        for (unsigned int spins = 0;
+             atomic_load_explicit(&node->waiting, memory_order_acquire); spins++) {
+            queue_lock_wait(spins);
+        }
+    }
+
+    l->holder = node;
+    return 0;
+}
+
+int mcs_unlock(struct mcs_lock *l)
+{
+    struct mcs_node *node = l->holder;
+    struct mcs_node *next = atomic_load_explicit(&node->next, memory_order_acquire);
+
+    if (next == NULL) {
+        struct mcs_node *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&l->tail, &expected, NULL,
+                                                    memory_order_release,
+                                                    memory_order_relaxed)) {
+            mcs_node_used[node - mcs_nodes] = false;
+            return 0;
+        }
+        // A waiter swapped itself in but has not linked to us yet
+        for (unsigned int spins = 0;
+             (next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL;
+             spins++) {
+            queue_lock_wait(spins);
+        }
+    }
+
+    atomic_store_explicit(&next->waiting, 0, memory_order_release);
+    mcs_node_used[node - mcs_nodes] = false;
+    return 0;
+}
+
+static int mcs_op_lock(void *lock)
+{
+    return mcs_lock((struct mcs_lock *)lock);
+}
+
+static int mcs_op_unlock(void *lock)
+{
+    return mcs_unlock((struct mcs_lock *)lock);
+}
+
+const struct thread_lock_ops mcs_lock_ops = {
+    .name   = "mcs",
+    .lock   = mcs_op_lock,
+    .unlock = mcs_op_unlock,
+};
@@ -0,0 +1,99 @@
+/**
+ * locks.h
+ *
+ * Alternative lock types for the threading library.  Each one comes with
+ * a struct thread_lock_ops, so it can be used with
+ * start_thread_obtaining_lock() wherever a pthread_mutex_t would be used
+ * with start_thread_obtaining_mutex().  Linux only (futex).
+ */
+
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "threading.h"
+
+#define SPINPARK_SPIN_MIN 16
+#define SPINPARK_SPIN_MAX 4096
+
+/**
+ * Mutex that spins with exponential backoff for a bounded number of
+ * iterations, then parks in the kernel on a futex.  The spin budget adapts
+ * per mutex: it follows the spinning that successful acquisitions needed,
+ * and shrinks whenever spinning failed and the thread had to park, so a
+ * mutex held for long stops wasting CPU on spinning.
+ */
+struct spinpark_mutex {
+    atomic_int state;           // 0 unlocked, 1 locked, 2 locked with sleepers
+    atomic_int spin_limit;      // current spin budget, in pause iterations
+};
+
+#define SPINPARK_MUTEX_INITIALIZER { 0, SPINPARK_SPIN_MIN * 4 }
+
+void spinpark_mutex_init(struct spinpark_mutex *m);
+
+/**
+ * Lock and unlock @param m.  Always return 0.
+ */
+int spinpark_lock(struct spinpark_mutex *m);
+int spinpark_unlock(struct spinpark_mutex *m);
+
+extern const struct thread_lock_ops spinpark_lock_ops;
+
+/**
+ * FIFO spin locks for heavily contended mutexes, where a plain mutex lets
+ * the thread that just unlocked take the lock again and starve others.
+ * Waiters spin, yielding the CPU after QUEUE_LOCK_SPINS_BEFORE_YIELD
+ * iterations so an oversubscribed machine still makes progress.
+ */
+#define QUEUE_LOCK_SPINS_BEFORE_YIELD 1024
+
+/**
+ * Ticket lock: acquirers take a ticket and wait until it is served.  All
+ * waiters poll the same cache line, which is written on every release.
+ */
+struct ticket_lock {
+    atomic_uint next;           // next ticket to hand out
+    atomic_uint owner;          // ticket being served
+};
+
+#define TICKET_LOCK_INITIALIZER { 0, 0 }
+
+void ticket_lock_init(struct ticket_lock *l);
+int ticket_lock(struct ticket_lock *l);
+int ticket_unlock(struct ticket_lock *l);
+
+extern const struct thread_lock_ops ticket_lock_ops;
+
+/**
+ * MCS lock: waiters form a queue of nodes and each one spins on its own
+ * node, so a release only touches the cache line of the next waiter.
+ */
+struct mcs_node {
+    _Atomic(struct mcs_node *) next;
+    atomic_int waiting;
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+    _Atomic(struct mcs_node *) tail;
+    struct mcs_node *holder;    // node of the current owner
+};
+
+#define MCS_LOCK_INITIALIZER { NULL, NULL }
+#define MCS_MAX_NESTING 8       // MCS locks one thread may hold at once
+
+void mcs_lock_init(struct mcs_lock *l);
+
+/**
+ * Lock and unlock @param l with a queue node of the calling thread.
+ * mcs_lock() returns EAGAIN if the thread already holds MCS_MAX_NESTING
+ * MCS locks, 0 otherwise; mcs_unlock() always returns 0.
+ */
+int mcs_lock(struct mcs_lock *l);
+int mcs_unlock(struct mcs_lock *l);
+
+extern const struct thread_lock_ops mcs_lock_ops;
+
+#endif /* LOCKS_H */
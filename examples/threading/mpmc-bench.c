@@ -0,0 +1,337 @@
+/**
+ * mpmc-bench.c
+ *
+ * Stress test and benchmark of the lock-free MPMC ring against a bounded
+ * queue protected by a mutex and two condition variables:
+ *
+ *   make bench && ./mpmc-bench -q mpmc,mutex -c 1x1,4x4 -n 1000000
+ *
+ * For every queue and producers x consumers configuration, each producer
+ * queues -n numbered items and the consumers take them until they get an
+ * end marker.  Every run is checked: all items must arrive exactly once
+ * (count and sum of the numbers), and each consumer must see the items of
+ * a producer in the order they were queued.  The ring is waited on by
+ * spinning and then yielding when it is full or empty.
+ *
+ * Prints one line of "key=value" pairs per run, and exits with 1 if a
+ * check failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "mpmc.h"
+
+#define MAX_PRODUCERS 64
+#define MAX_CONSUMERS 64
+// Items are pointers holding the producer id above a sequence number of SEQ_BITS bits
+#if UINTPTR_MAX > 0xffffffffu
+#define SEQ_BITS 40
+#else
+#define SEQ_BITS 24
+#endif
+#define SPINS_BEFORE_YIELD 64
+
+static long items_per_producer = 1000000;
+static size_t capacity = 1024;
+
+/**
+ * Bounded FIFO protected by a mutex, the pattern the ring replaces.
+ */
+struct locked_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    void **items;
+    size_t head;
+    size_t count;
+};
+
+static int locked_queue_init(struct locked_queue *q)
+{
+    q->items = malloc(capacity * sizeof(void *));
+    if (q->items == NULL) {
+        return ENOMEM;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    q->head = 0;
+    q->count = 0;
+    return 0;
+}
+
+static void locked_queue_destroy(struct locked_queue *q)
+{
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+static void locked_queue_push(struct locked_queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *locked_queue_pop(struct locked_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static void backoff(unsigned int *spins)
+{
+    if (++*spins % SPINS_BEFORE_YIELD == 0) {
+        sched_yield();
+    }
+}
+
+static void ring_push_wait(struct mpmc_ring *ring, void *item)
+{
+    unsigned int spins = 0;
+    while (!mpmc_ring_push(ring, item)) {
+        backoff(&spins);
+    }
+}
+
+static void *ring_pop_wait(struct mpmc_ring *ring)
+{
+    unsigned int spins = 0;
+    void *item;
+    while (!mpmc_ring_pop(ring, &item)) {
+        backoff(&spins);
+    }
+    return item;
+}
+
+struct bench_run {
+    bool lock_free;
+    struct mpmc_ring ring;
+    struct locked_queue locked;
+    int nproducers;
+};
+
+static void push(struct bench_run *run, void *item)
+{
+    if (run->lock_free) {
+        ring_push_wait(&run->ring, item);
+    } else {
+        locked_queue_push(&run->locked, item);
+    }
+}
+
+static void *pop(struct bench_run *run)
+{
+    return run->lock_free ? ring_pop_wait(&run->ring) : locked_queue_pop(&run->locked);
+}
+
+struct producer {
+    pthread_t thread;
+    struct bench_run *run;
+    int id;
+};
+
+/**
+ * What a consumer got.  Items are numbered from 1 within each producer,
+ * the producer id goes in the high bits, and the end marker is NULL.
+ */
+struct consumer {
+    pthread_t thread;
+    struct bench_run *run;
+    long count;
+    unsigned long long sum;
+    bool out_of_order;
+    long last[MAX_PRODUCERS];
+};
+
+static void *producer_main(void *arg)
+{
+    struct producer *p = arg;
+    for (long seq = 1; seq <= items_per_producer; seq++) {
+        push(p->run, (void *)(((uintptr_t)p->id << SEQ_BITS) | (uintptr_t)seq));
+    }
+    return NULL;
+}
+
+static void *consumer_main(void *arg)
+{
+    struct consumer *c = arg;
+    for (;;) {
+        uintptr_t item = (uintptr_t)pop(c->run);
+        if (item == 0) {
+            return NULL;
+        }
+        int id = item >> SEQ_BITS;
+        long seq = item & (((uintptr_t)1 << SEQ_BITS) - 1);
+        if (id >= c->run->nproducers || seq <= c->last[id]) {
+            c->out_of_order = true;
+        }
+        c->last[id] = seq;
+        c->count++;
+        c->sum += seq;
+    }
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int run_case(bool lock_free, int nproducers, int nconsumers)
+{
+    struct bench_run run = { .lock_free = lock_free, .nproducers = nproducers };
+    int rc = lock_free ? mpmc_ring_init(&run.ring, capacity) : locked_queue_init(&run.locked);
+    if (rc != 0) {
+        fprintf(stderr, "queue init: %s\n", strerror(rc));
+        return 1;
+    }
+
+    struct producer producers[MAX_PRODUCERS];
+    struct consumer *consumers = calloc(nconsumers, sizeof(struct consumer));
+    if (consumers == NULL) {
+        rc = 1;
+        goto out;
+    }
+
+    long long start_ns = now_ns();
+    int nstarted = 0, cstarted = 0;
+    for (; cstarted < nconsumers; cstarted++) {
+        consumers[cstarted].run = &run;
+        if (pthread_create(&consumers[cstarted].thread, NULL, consumer_main,
+                           &consumers[cstarted]) != 0) {
+            break;
+        }
+    }
+    for (; cstarted == nconsumers && nstarted < nproducers; nstarted++) {
+        producers[nstarted].run = &run;
+        producers[nstarted].id = nstarted;
+        if (pthread_create(&producers[nstarted].thread, NULL, producer_main,
+                           &producers[nstarted]) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    for (int i = 0; i < cstarted; i++) {
+        push(&run, NULL);
+    }
+    for (int i = 0; i < cstarted; i++) {
+        pthread_join(consumers[i].thread, NULL);
+    }
+    long long elapsed_ns = now_ns() - start_ns;
+
+    if (cstarted != nconsumers || nstarted != nproducers) {
+        fprintf(stderr, "pthread_create failed\n");
+        rc = 1;
+        goto out;
+    }
+
+    long count = 0;
+    unsigned long long sum = 0;
+    bool ordered = true;
+    for (int i = 0; i < nconsumers; i++) {
+        count += consumers[i].count;
+        sum += consumers[i].sum;
+        ordered &= !consumers[i].out_of_order;
+    }
+    long total = items_per_producer * nproducers;
+    unsigned long long expected_sum = (unsigned long long)nproducers *
+                                      items_per_producer * (items_per_producer + 1) / 2;
+    bool verified = count == total && sum == expected_sum && ordered;
+
+    printf("queue=%s producers=%d consumers=%d capacity=%zu items=%ld elapsed_ms=%lld "
+           "ops_per_sec=%.0f verified=%d\n", lock_free ? "mpmc" : "mutex", nproducers,
+           nconsumers, capacity, total, elapsed_ns / 1000000, total * 1e9 / elapsed_ns,
+           verified);
+    if (!verified) {
+        fprintf(stderr, "check failed: count=%ld/%ld sum=%llu/%llu ordered=%d\n",
+                count, total, sum, expected_sum, ordered);
+        rc = 1;
+    }
+
+out:
+    free(consumers);
+    if (lock_free) {
+        mpmc_ring_destroy(&run.ring);
+    } else {
+        locked_queue_destroy(&run.locked);
+    }
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-q mpmc,mutex] [-c producersxconsumers,...]\n"
+            "          [-n items_per_producer] [-s capacity]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *queues = "mpmc,mutex";
+    char config_list[256] = "1x1,1x4,4x1,4x4,16x16";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "q:c:n:s:")) != -1) {
+        switch (opt) {
+        case 'q': queues = optarg; break;
+        case 'c': snprintf(config_list, sizeof(config_list), "%s", optarg); break;
+        case 'n': items_per_producer = atol(optarg); break;
+        case 's': capacity = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (items_per_producer <= 0 || (uintptr_t)items_per_producer >= ((uintptr_t)1 << SEQ_BITS) ||
+        capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int rc = 0;
+    char *save = NULL;
+    for (char *c = strtok_r(config_list, ",", &save); c; c = strtok_r(NULL, ",", &save)) {
+        int nproducers, nconsumers;
+        if (sscanf(c, "%dx%d", &nproducers, &nconsumers) != 2 ||
+            nproducers < 1 || nproducers > MAX_PRODUCERS ||
+            nconsumers < 1 || nconsumers > MAX_CONSUMERS) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strstr(queues, "mpmc") && run_case(true, nproducers, nconsumers) != 0) {
+            rc = 1;
+        }
+        if (strstr(queues, "mutex") && run_case(false, nproducers, nconsumers) != 0) {
+            rc = 1;
+        }
+    }
+    return rc;
+}
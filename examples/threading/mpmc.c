@@ -0,0 +1,98 @@
+/**
+ * mpmc.c
+ *
+ * Bounded lock-free MPMC ring, see mpmc.h.
+ */
+
+#include "mpmc.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+int mpmc_ring_init(struct mpmc_ring *ring, size_t capacity)
+{
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        return EINVAL;
+    }
+
+    ring->cells = aligned_alloc(MPMC_CACHE_LINE,
+                                (capacity * sizeof(struct mpmc_cell) + MPMC_CACHE_LINE - 1) /
+                                MPMC_CACHE_LINE * MPMC_CACHE_LINE);
+    if (ring->cells == NULL) {
+        return ENOMEM;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+        ring->cells[i].data = NULL;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+void mpmc_ring_destroy(struct mpmc_ring *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool mpmc_ring_push(struct mpmc_ring *ring, void *item)
+{
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // The cell is free for this position: claim it
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The cell still holds the item from one lap ago
+            return false;
+        } else {
+            // Another producer took this position, catch up
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->data = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool mpmc_ring_pop(struct mpmc_ring *ring, void **item)
+{
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // The cell holds the item for this position: claim it
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Nothing was pushed to this position yet
+            return false;
+        } else {
+            // Another consumer took this position, catch up
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *item = cell->data;
+    // Free the cell for the producer one lap later
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    return true;
+}
@@ -0,0 +1,63 @@
+/**
+ * mpmc.h
+ *
+ * Bounded multi-producer multi-consumer queue of pointers without locks,
+ * after Dmitry Vyukov's design: every cell carries a sequence number that
+ * tells producers and consumers whose turn it is, so an operation is one
+ * compare-and-swap on a position plus a store to the cell, and threads
+ * only contend when they go for the same cell.
+ */
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define MPMC_CACHE_LINE 64
+
+/**
+ * Each cell fills a cache line of its own, so a producer and a consumer
+ * working on neighbouring positions do not pass one line back and forth.
+ * This takes MPMC_CACHE_LINE bytes per item instead of 16.
+ */
+struct mpmc_cell {
+    _Alignas(MPMC_CACHE_LINE) atomic_size_t seq;    // position this cell is ready for
+    void *data;
+};
+
+/**
+ * The producer and consumer positions sit on cache lines of their own, so
+ * producers do not invalidate the line consumers spin on and vice versa.
+ */
+struct mpmc_ring {
+    struct mpmc_cell *cells;
+    size_t mask;                // capacity - 1
+    _Alignas(MPMC_CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(MPMC_CACHE_LINE) atomic_size_t dequeue_pos;
+};
+
+/**
+ * Initialize @param ring for @param capacity items, a power of two of at
+ * least 2.  Returns 0, EINVAL for a bad capacity or ENOMEM.
+ */
+int mpmc_ring_init(struct mpmc_ring *ring, size_t capacity);
+
+/**
+ * Free the cells of @param ring.  Items still queued are dropped.
+ */
+void mpmc_ring_destroy(struct mpmc_ring *ring);
+
+/**
+ * Queue @param item.  Returns false, without waiting, if the ring is full.
+ */
+bool mpmc_ring_push(struct mpmc_ring *ring, void *item);
+
+/**
+ * Take the oldest item into @param item.  Returns false, without waiting,
+ * if the ring is empty.
+ */
+bool mpmc_ring_pop(struct mpmc_ring *ring, void **item);
+
+#endif /* MPMC_H */
@@ -0,0 +1,225 @@
+/**
+ * pi-latency.c
+ *
+ * Priority inversion test for the real-time options of the threading
+ * library:
+ *
+ *   make bench && sudo ./pi-latency -r 20 -H 20 -B 50
+ *
+ * Every round runs three SCHED_FIFO threads on one CPU.  A low priority
+ * delayed lock operation obtains the mutex at once and holds it -H
+ * milliseconds; a medium priority thread busy-loops for -B milliseconds
+ * from 2 ms on, preempting it; a high priority operation wants the mutex
+ * at 5 ms.  With a plain mutex the high priority thread waits until the
+ * medium one is done, with a priority inheritance mutex the owner runs at
+ * the waiter's priority and the wait is bounded by the hold time.
+ *
+ * Prints one line of "key=value" pairs per mutex protocol, with the wait
+ * of the high priority thread and whether it stayed within the bound.
+ * Prints "skipped=EPERM" and succeeds when real-time scheduling is not
+ * allowed.  Exits with 1 if the inheriting mutex missed the bound.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "threading.h"
+
+#define PRIO_LOW    10
+#define PRIO_MEDIUM 20
+#define PRIO_HIGH   30
+
+#define MEDIUM_START_MS 2
+#define HIGH_START_MS   5
+#define BOUND_SLACK_NS  (2 * 1000000LL)  // wake-up and switch latency allowed
+
+static int rounds = 20;
+static int hold_ms = 20;
+static int busy_ms = 50;
+static int cpu = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(long long deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/**
+ * Medium priority thread: sleeps until its start time, then keeps the CPU
+ * busy without touching the mutex.
+ */
+static void *medium_main(void *arg)
+{
+    long long start_ns = *(long long *)arg;
+    sleep_until_ns(start_ns);
+    long long end_ns = start_ns + busy_ms * 1000000LL;
+    while (now_ns() < end_ns) {
+    }
+    return NULL;
+}
+
+static int start_medium(pthread_t *thread, long long *start_ns)
+{
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = PRIO_MEDIUM };
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    int rc = pthread_create(thread, &attr, medium_main, start_ns);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+static struct thread_data *join(pthread_t thread)
+{
+    struct thread_data *data = NULL;
+    pthread_join(thread, (void **)&data);
+    return data;
+}
+
+/**
+ * Run all rounds with @param mutex.  Returns 0 and the longest wait of the
+ * high priority thread in @param max_wait_ns, or the error that kept a
+ * thread from starting.
+ */
+static int run_rounds(pthread_mutex_t *mutex, long long *max_wait_ns, long long *total_wait_ns)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    struct thread_options low = {
+        .sched_policy = SCHED_FIFO,
+        .sched_priority = PRIO_LOW,
+        .cpu_set = &cpus,
+    };
+    struct thread_options high = low;
+    high.sched_priority = PRIO_HIGH;
+
+    *max_wait_ns = 0;
+    *total_wait_ns = 0;
+    for (int r = 0; r < rounds; r++) {
+        pthread_t low_thread, high_thread, medium_thread;
+        long long medium_start_ns = now_ns() + MEDIUM_START_MS * 1000000LL;
+
+        if (!start_thread_obtaining_mutex_opts(&low_thread, mutex, 0, hold_ms, &low)) {
+            return errno;
+        }
+        if (!start_thread_obtaining_mutex_opts(&high_thread, mutex, HIGH_START_MS, 0, &high)) {
+            int rc = errno;
+            free(join(low_thread));
+            return rc;
+        }
+        int rc = start_medium(&medium_thread, &medium_start_ns);
+        if (rc == 0) {
+            pthread_join(medium_thread, NULL);
+        }
+
+        struct thread_data *low_data = join(low_thread);
+        struct thread_data *high_data = join(high_thread);
+        if (rc == 0 && (!low_data->thread_complete_success ||
+                        !high_data->thread_complete_success)) {
+            rc = EIO;
+        }
+        if (rc == 0) {
+            *total_wait_ns += high_data->lock_wait_ns;
+            if (high_data->lock_wait_ns > *max_wait_ns) {
+                *max_wait_ns = high_data->lock_wait_ns;
+            }
+        }
+        free(low_data);
+        free(high_data);
+        if (rc != 0) {
+            return rc;
+        }
+
+        // Let the CPU idle between rounds, away from the real-time throttle
+        usleep(20 * 1000);
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r rounds] [-H hold_ms] [-B busy_ms] [-c cpu]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "r:H:B:c:")) != -1) {
+        switch (opt) {
+        case 'r': rounds = atoi(optarg); break;
+        case 'H': hold_ms = atoi(optarg); break;
+        case 'B': busy_ms = atoi(optarg); break;
+        case 'c': cpu = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (rounds <= 0 || hold_ms <= HIGH_START_MS || busy_ms <= 0 || cpu < 0 || cpu >= CPU_SETSIZE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The high priority thread asks at HIGH_START_MS, the owner releases at hold_ms
+    long long bound_ns = (hold_ms - HIGH_START_MS) * 1000000LL + BOUND_SLACK_NS;
+    static const char *protocols[] = { "none", "inherit" };
+    int status = 0;
+
+    for (int p = 0; p < 2; p++) {
+        pthread_mutex_t mutex;
+        int rc = p == 0 ? pthread_mutex_init(&mutex, NULL) : thread_mutex_init_pi(&mutex);
+        if (rc != 0) {
+            fprintf(stderr, "mutex init: %s\n", strerror(rc));
+            return 1;
+        }
+
+        long long max_wait_ns, total_wait_ns;
+        rc = run_rounds(&mutex, &max_wait_ns, &total_wait_ns);
+        pthread_mutex_destroy(&mutex);
+        if (rc == EPERM) {
+            printf("pi-latency skipped=EPERM\n");
+            return 0;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "round failed: %s\n", strerror(rc));
+            return 1;
+        }
+
+        int within = max_wait_ns <= bound_ns;
+        printf("pi-latency protocol=%s rounds=%d hold_ms=%d busy_ms=%d "
+               "avg_wait_us=%lld max_wait_us=%lld bound_us=%lld within_bound=%d\n",
+               protocols[p], rounds, hold_ms, busy_ms, total_wait_ns / rounds / 1000,
+               max_wait_ns / 1000, bound_ns / 1000, within);
+        if (p == 1 && !within) {
+            status = 1;
+        }
+    }
+    return status;
+}
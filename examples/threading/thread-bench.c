@@ -0,0 +1,283 @@
+/**
+ * thread-bench.c
+ *
+ * Costs of the threading library that depend on the kernel and libc:
+ *
+ *   make bench && ./thread-bench -n 2000 -w 0,1,10 -t 1,16,128
+ *
+ * - create: threads created and joined per second, for an empty thread
+ *   and for start_thread_obtaining_mutex() with no waits.
+ * - handoff: time from one thread unlocking a mutex to the thread blocked
+ *   on it returning from pthread_mutex_lock().
+ * - accuracy: how late the delayed lock threads wake up to obtain and
+ *   release the mutex, for every wait (-w, in milliseconds) and thread
+ *   count (-t); lock_wait is the time spent blocked on the mutex.
+ *
+ * Prints a "system" line identifying the kernel and libc, then one line
+ * of "key=value" pairs per result.  Times are in nanoseconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/utsname.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+
+#include "threading.h"
+
+#define MAX_THREADS 4096
+
+static int iterations = 2000;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print the distribution of the @param n samples of @param ns as
+ * "<name>_p50=... <name>_p99=... <name>_max=...", sorting them.
+ */
+static void print_percentiles(const char *name, long long *ns, int n)
+{
+    qsort(ns, n, sizeof(*ns), compare_ll);
+    printf(" %s_p50=%lld %s_p99=%lld %s_max=%lld", name, ns[n / 2],
+           name, ns[(int)((n - 1) * 0.99)], name, ns[n - 1]);
+}
+
+static void *empty_main(void *arg)
+{
+    return arg;
+}
+
+static int bench_create(void)
+{
+    long long start_ns = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, empty_main, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+        pthread_join(thread, NULL);
+    }
+    long long elapsed_ns = now_ns() - start_ns;
+    printf("test=create kind=pthread iterations=%d per_sec=%.0f avg_ns=%lld\n",
+           iterations, iterations * 1e9 / elapsed_ns, elapsed_ns / iterations);
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    start_ns = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        pthread_t thread;
+        struct thread_data *data;
+        if (!start_thread_obtaining_mutex(&thread, &mutex, 0, 0)) {
+            fprintf(stderr, "start_thread_obtaining_mutex failed\n");
+            return 1;
+        }
+        pthread_join(thread, (void **)&data);
+        free(data);
+    }
+    elapsed_ns = now_ns() - start_ns;
+    printf("test=create kind=obtaining_mutex iterations=%d per_sec=%.0f avg_ns=%lld\n",
+           iterations, iterations * 1e9 / elapsed_ns, elapsed_ns / iterations);
+    return 0;
+}
+
+/**
+ * Two threads taking turns: the owner of the turn unlocks the mutex the
+ * other one is blocked on.  Turns are passed with a separate counter so
+ * the unlock always has a waiter.
+ */
+struct handoff {
+    pthread_mutex_t mutex;
+    atomic_int turn;                // iteration the waiter may start
+    atomic_int done;                // iterations the waiter completed
+    atomic_llong unlocked_ns;       // when the holder unlocked
+    long long *latency_ns;
+};
+
+static void *handoff_waiter(void *arg)
+{
+    struct handoff *h = arg;
+    for (int i = 0; i < iterations; i++) {
+        while (atomic_load(&h->turn) != i) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&h->mutex);
+        h->latency_ns[i] = now_ns() - atomic_load(&h->unlocked_ns);
+        pthread_mutex_unlock(&h->mutex);
+        atomic_store(&h->done, i + 1);
+    }
+    return NULL;
+}
+
+static int bench_handoff(void)
+{
+    struct handoff h;
+    pthread_mutex_init(&h.mutex, NULL);
+    atomic_init(&h.turn, -1);
+    atomic_init(&h.done, 0);
+    atomic_init(&h.unlocked_ns, 0);
+    h.latency_ns = malloc(iterations * sizeof(long long));
+    if (h.latency_ns == NULL) {
+        return 1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_waiter, &h) != 0) {
+        free(h.latency_ns);
+        return 1;
+    }
+    for (int i = 0; i < iterations; i++) {
+        pthread_mutex_lock(&h.mutex);
+        atomic_store(&h.turn, i);
+        // Give the waiter time to block on the mutex
+        struct timespec ts = { 0, 50 * 1000 };
+        nanosleep(&ts, NULL);
+        atomic_store(&h.unlocked_ns, now_ns());
+        pthread_mutex_unlock(&h.mutex);
+        // Wait until the waiter got it, so we do not take it back first
+        while (atomic_load(&h.done) != i + 1) {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+
+    printf("test=handoff iterations=%d", iterations);
+    print_percentiles("latency", h.latency_ns, iterations);
+    printf("\n");
+    free(h.latency_ns);
+    pthread_mutex_destroy(&h.mutex);
+    return 0;
+}
+
+static int bench_accuracy(int wait_ms, int nthreads)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    long long *obtain_ns = calloc(nthreads, sizeof(long long));
+    long long *release_ns = calloc(nthreads, sizeof(long long));
+    long long *lock_wait_ns = calloc(nthreads, sizeof(long long));
+    int started = 0, ok = 0;
+    if (threads == NULL || obtain_ns == NULL || release_ns == NULL || lock_wait_ns == NULL) {
+        goto out;
+    }
+
+    for (; started < nthreads; started++) {
+        if (!start_thread_obtaining_mutex(&threads[started], &mutex, wait_ms, wait_ms)) {
+            fprintf(stderr, "start_thread_obtaining_mutex failed\n");
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        struct thread_data *data;
+        pthread_join(threads[i], (void **)&data);
+        if (data->thread_complete_success) {
+            obtain_ns[ok] = data->obtain_lateness_ns;
+            release_ns[ok] = data->release_lateness_ns;
+            lock_wait_ns[ok] = data->lock_wait_ns;
+            ok++;
+        }
+        free(data);
+    }
+
+    if (ok > 0) {
+        printf("test=accuracy wait_ms=%d threads=%d completed=%d", wait_ms, nthreads, ok);
+        print_percentiles("obtain_late", obtain_ns, ok);
+        print_percentiles("release_late", release_ns, ok);
+        print_percentiles("lock_wait", lock_wait_ns, ok);
+        printf("\n");
+    }
+
+out:
+    free(threads);
+    free(obtain_ns);
+    free(release_ns);
+    free(lock_wait_ns);
+    return ok == nthreads ? 0 : 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-T create,handoff,accuracy] [-n iterations]\n"
+            "          [-w wait_ms,...] [-t threads,...]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tests = "create,handoff,accuracy";
+    char wait_list[256] = "0,1,10";
+    char thread_list[256] = "1,16,128";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "T:n:w:t:")) != -1) {
+        switch (opt) {
+        case 'T': tests = optarg; break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'w': snprintf(wait_list, sizeof(wait_list), "%s", optarg); break;
+        case 't': snprintf(thread_list, sizeof(thread_list), "%s", optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    char libc[64] = "unknown";
+#ifdef __GLIBC__
+    snprintf(libc, sizeof(libc), "glibc-%s", gnu_get_libc_version());
+#endif
+    printf("system kernel=%s machine=%s libc=%s cpus=%ld\n", uts.release, uts.machine, libc,
+           sysconf(_SC_NPROCESSORS_ONLN));
+
+    int rc = 0;
+    if (strstr(tests, "create") && bench_create() != 0) {
+        rc = 1;
+    }
+    if (strstr(tests, "handoff") && bench_handoff() != 0) {
+        rc = 1;
+    }
+    if (strstr(tests, "accuracy")) {
+        char *wait_save = NULL;
+        for (char *w = strtok_r(wait_list, ",", &wait_save); w;
+             w = strtok_r(NULL, ",", &wait_save)) {
+            char threads_copy[256];
+            snprintf(threads_copy, sizeof(threads_copy), "%s", thread_list);
+            char *thread_save = NULL;
+            for (char *t = strtok_r(threads_copy, ",", &thread_save); t;
+                 t = strtok_r(NULL, ",", &thread_save)) {
+                int nthreads = atoi(t);
+                if (atoi(w) < 0 || nthreads < 1 || nthreads > MAX_THREADS) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                if (bench_accuracy(atoi(w), nthreads) != 0) {
+                    rc = 1;
+                }
+            }
+        }
+    }
+    return rc;
+}
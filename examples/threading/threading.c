@@ -1,9 +1,18 @@
+#define _GNU_SOURCE     // pthread_mutex_clocklock, pthread_attr_setaffinity_np
+ 
 #include "threading.h"
  
-#include <unistd.h>     // usleep
 #include <stdlib.h>     // malloc, free
 #include <pthread.h>    // pthread_*
 #include <stdbool.h>    // bool
+#include <stdint.h>     // uintptr_t
+#include <errno.h>      // EBUSY
+#include <time.h>       // clock_gettime, clock_nanosleep
+#include <limits.h>     // PTHREAD_STACK_MIN
+#include <unistd.h>     // read, write, close
+#include <stdatomic.h>  // completion queue stack
+#include <sched.h>      // sched_yield
+#include <sys/eventfd.h> // eventfd
  
 /**
  * Internal struct used only in this file.
@@ -13,22 +22,140 @@
  */
 struct thread_info {
     struct thread_data pub;          // must be first
-    pthread_mutex_t *mutex;
+    pthread_mutex_t *mutex;          // NULL for other lock types
+    const struct thread_lock_ops *ops;
+    void *lock;                      // lock passed to ops, mutex by default
     int wait_to_obtain_ms;
     int wait_to_release_ms;
+    long long start_ns;              // CLOCK_MONOTONIC time of the request
+    long long obtain_deadline_ns;    // give up obtaining at this time, -1 for never
+    struct thread_cancel_token *cancel;
+ 
+    // Only used by tasks queued on a thread_pool or lock_scheduler, or
+    // posted to a completion_queue
+    struct thread_info *next;        // task queue / completion stack link
+    struct completion_queue *cq;     // where to post the result, if any
+    bool done;                       // completed, guarded by the pool/shard lock
+ 
+    // Only used by a lock_scheduler
+    long long deadline_ns;           // CLOCK_MONOTONIC time of the next step
+    int step;                        // SCHED_STEP_*
+    int retry_ns;                    // current backoff while the mutex is busy
+    struct thread_info *waiters;     // operations parked until we release the mutex
+    struct thread_info *waiters_tail;
+};
+ 
+/**
+ * Persistent worker threads serving a FIFO queue of thread_info tasks.
+ */
+struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;        // task queued or shutting down
+    pthread_cond_t done_cond;        // a task completed
+    struct thread_info *head;        // next task to run
+    struct thread_info *tail;
+    bool shutdown;
+    int nthreads;                    // workers started
+    pthread_t threads[];
+};
+ 
+#define SCHED_STEP_OBTAIN  0
+#define SCHED_STEP_RELEASE 1
+#define SCHED_RETRY_MIN_NS (50 * 1000)
+#define SCHED_RETRY_MAX_NS (5 * 1000 * 1000)
+ 
+/**
+ * One timer thread of a lock_scheduler with a min-heap of pending
+ * operations, ordered by the deadline of their next step.
+ * The first operation to want a mutex is registered as its holder (while
+ * it still polls a mutex held outside the scheduler, too); later ones wait
+ * in the holder's waiters list and are handed the mutex in turn, so at
+ * most one operation per mutex ever polls.
+ */
+struct sched_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;             // heap changed or shutting down
+    pthread_cond_t done_cond;        // an operation completed
+    struct thread_info **heap;
+    size_t count;
+    size_t capacity;
+    struct thread_info **held;       // open addressing table of holders by mutex
+    size_t held_count;
+    size_t held_capacity;            // power of two
+    bool shutdown;
+    bool started;
+    pthread_t thread;
+};
+ 
+struct lock_scheduler {
+    int nshards;
+    struct sched_shard shards[];
 };
  
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+ 
+/**
+ * Sleep until CLOCK_MONOTONIC reaches @param deadline_ns.  Sleeping to an
+ * absolute deadline does not accumulate the drift of relative sleeps.
+ * Returns how many nanoseconds after the deadline the thread woke up.
+ */
+static long long sleep_until(long long deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        // Interrupted by a signal handler: the deadline stays the same
+    }
+    return monotonic_ns() - deadline_ns;
+}
+ 
+/**
+ * Like sleep_until(), but return early if @param token gets cancelled.
+ * Returns true if the token was cancelled, otherwise leaves the lateness
+ * of the wake-up in @param lateness_ns.
+ */
+static bool sleep_until_cancelled(long long deadline_ns, struct thread_cancel_token *token,
+                                  long long *lateness_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+    pthread_mutex_lock(&token->lock);
+    while (!token->cancelled &&
+           pthread_cond_timedwait(&token->cond, &token->lock, &ts) != ETIMEDOUT) {
+        // Spurious wake-up or another operation's cancellation check
+    }
+    bool cancelled = token->cancelled;
+    pthread_mutex_unlock(&token->lock);
+    if (!cancelled) {
+        *lateness_ns = monotonic_ns() - deadline_ns;
+    }
+    return cancelled;
+}
+ 
 /**
  * This function is run in the new thread created by
  * start_thread_obtaining_mutex().
  *
  * It will:
- *   1. Sleep for wait_to_obtain_ms milliseconds
+ *   1. Sleep until wait_to_obtain_ms milliseconds after the request
  *   2. Lock the supplied mutex
- *   3. Sleep for wait_to_release_ms milliseconds
+ *   3. Sleep until wait_to_release_ms milliseconds after obtaining it
  *   4. Unlock the mutex
  *
- * It sets thread_complete_success = true only if all operations succeed.
+ * It sets thread_complete_success = true only if all operations succeed,
+ * and records how late each wake-up was and how long locking blocked.
+ * With an obtain deadline it stops waiting for the mutex at the deadline,
+ * and with a cancel token it ends early, without touching the mutex, once
+ * it is cancelled.
  */
 void* threadfunc(void* thread_param)
 {
@@ -41,30 +168,211 @@ void* threadfunc(void* thread_param)
  
     // Assume failure unless everything succeeds
     data->thread_complete_success = false;
+    data->outcome = THREAD_OUTCOME_FAILED;
  
     // 1) Wait before obtaining the mutex
-    usleep((useconds_t)info->wait_to_obtain_ms * 1000);
+    long long obtain_ns = info->start_ns + info->wait_to_obtain_ms * 1000000LL;
+    if (info->cancel != NULL) {
+        if (sleep_until_cancelled(obtain_ns, info->cancel, &data->obtain_lateness_ns)) {
+            data->outcome = THREAD_OUTCOME_CANCELLED;
+            return data;
+        }
+    } else {
+        data->obtain_lateness_ns = sleep_until(obtain_ns);
+    }
  
     // 2) Lock the mutex
-    if (pthread_mutex_lock(info->mutex) != 0) {
+    long long lock_start_ns = monotonic_ns();
+    int rc;
+    if (info->obtain_deadline_ns < 0) {
+        rc = info->ops->lock(info->lock);
+    } else if (info->ops->timedlock != NULL) {
+        rc = info->ops->timedlock(info->lock, info->obtain_deadline_ns);
+    } else {
+        rc = lock_start_ns < info->obtain_deadline_ns ? info->ops->lock(info->lock) : ETIMEDOUT;
+    }
+    if (rc == ETIMEDOUT) {
+        data->outcome = THREAD_OUTCOME_TIMED_OUT;
+        return data;
+    }
+    if (rc != 0) {
         return data;    // failure, keep thread_complete_success = false
     }
+    long long obtained_ns = monotonic_ns();
+    data->lock_wait_ns = obtained_ns - lock_start_ns;
  
     // 3) Hold the mutex for some time
-    usleep((useconds_t)info->wait_to_release_ms * 1000);
+    data->release_lateness_ns = sleep_until(obtained_ns +
+                                            info->wait_to_release_ms * 1000000LL);
  
     // 4) Unlock the mutex
-    if (pthread_mutex_unlock(info->mutex) != 0) {
+    if (info->ops->unlock(info->lock) != 0) {
         return data;    // failure
     }
  
     // If we got here, everything worked
     data->thread_complete_success = true;
+    data->outcome = THREAD_OUTCOME_COMPLETED;
  
     // Return pointer that the joiner treats as struct thread_data*
     return data;
 }
  
+static int pthread_mutex_op_lock(void *lock)
+{
+    return pthread_mutex_lock((pthread_mutex_t *)lock);
+}
+ 
+static int pthread_mutex_op_unlock(void *lock)
+{
+    return pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+ 
+static int pthread_mutex_op_timedlock(void *lock, long long deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+    return pthread_mutex_clocklock((pthread_mutex_t *)lock, CLOCK_MONOTONIC, &ts);
+#else
+    // Only CLOCK_REALTIME deadlines: translate, accepting the clock jump risk
+    long long offset_ns = deadline_ns - monotonic_ns();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long realtime_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec + offset_ns;
+    ts.tv_sec = realtime_ns / 1000000000LL;
+    ts.tv_nsec = realtime_ns % 1000000000LL;
+    return pthread_mutex_timedlock((pthread_mutex_t *)lock, &ts);
+#endif
+}
+ 
+const struct thread_lock_ops thread_lock_pthread_mutex = {
+    .name      = "pthread_mutex",
+    .lock      = pthread_mutex_op_lock,
+    .unlock    = pthread_mutex_op_unlock,
+    .timedlock = pthread_mutex_op_timedlock,
+};
+ 
+int thread_cancel_token_init(struct thread_cancel_token *token)
+{
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init(&attr);
+    if (rc != 0) {
+        return rc;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    rc = pthread_cond_init(&token->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0) {
+        return rc;
+    }
+ 
+    rc = pthread_mutex_init(&token->lock, NULL);
+    if (rc != 0) {
+        pthread_cond_destroy(&token->cond);
+        return rc;
+    }
+    token->cancelled = false;
+    return 0;
+}
+ 
+void thread_cancel(struct thread_cancel_token *token)
+{
+    pthread_mutex_lock(&token->lock);
+    token->cancelled = true;
+    pthread_cond_broadcast(&token->cond);
+    pthread_mutex_unlock(&token->lock);
+}
+ 
+void thread_cancel_token_destroy(struct thread_cancel_token *token)
+{
+    pthread_cond_destroy(&token->cond);
+    pthread_mutex_destroy(&token->lock);
+}
+ 
+int thread_mutex_init_pi(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    int rc = pthread_mutexattr_init(&attr);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    if (rc == 0) {
+        rc = pthread_mutex_init(mutex, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return rc;
+}
+ 
+/**
+ * Fill @param attr with the scheduling and CPU affinity of @param options.
+ * Returns 0 on success, an error number otherwise.
+ */
+static int thread_attr_from_options(pthread_attr_t *attr, const struct thread_options *options)
+{
+    int rc = 0;
+    if (options->sched_policy != SCHED_OTHER) {
+        struct sched_param param = { .sched_priority = options->sched_priority };
+        rc = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (rc == 0) {
+            rc = pthread_attr_setschedpolicy(attr, options->sched_policy);
+        }
+        if (rc == 0) {
+            rc = pthread_attr_setschedparam(attr, &param);
+        }
+    }
+    if (rc == 0 && options->cpu_set != NULL) {
+        size_t size = options->cpu_set_size != 0 ? options->cpu_set_size : sizeof(cpu_set_t);
+        rc = pthread_attr_setaffinity_np(attr, size, options->cpu_set);
+    }
+    return rc;
+}
+ 
+/**
+ * Fill the descriptor of one delayed lock operation.
+ */
+static void thread_info_init(struct thread_info *info, pthread_mutex_t *mutex,
+                             int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    info->pub.thread_complete_success = false;
+    info->pub.outcome             = THREAD_OUTCOME_PENDING;
+    info->pub.obtain_lateness_ns  = -1;
+    info->pub.lock_wait_ns        = -1;
+    info->pub.release_lateness_ns = -1;
+    info->mutex              = mutex;
+    info->ops                = &thread_lock_pthread_mutex;
+    info->lock               = mutex;
+    info->wait_to_obtain_ms  = wait_to_obtain_ms;
+    info->wait_to_release_ms = wait_to_release_ms;
+    info->start_ns           = monotonic_ns();
+    info->obtain_deadline_ns = -1;
+    info->cancel             = NULL;
+    info->next               = NULL;
+    info->done               = false;
+    info->waiters            = NULL;
+    info->waiters_tail       = NULL;
+    info->cq                 = NULL;
+}
+ 
+/**
+ * Allocate and fill the descriptor of one delayed lock operation.
+ * Returns NULL if out of memory.
+ */
+static struct thread_info *thread_info_new(pthread_mutex_t *mutex,
+                                           int wait_to_obtain_ms,
+                                           int wait_to_release_ms)
+{
+    struct thread_info *info = malloc(sizeof(struct thread_info));
+    if (info == NULL) {
+        return NULL;
+    }
+ 
+    thread_info_init(info, mutex, wait_to_obtain_ms, wait_to_release_ms);
+    return info;
+}
+ 
 /**
  * Start a new thread which will:
  *   - Sleep wait_to_obtain_ms
@@ -79,19 +387,37 @@ bool start_thread_obtaining_mutex(pthread_t *thread,
                                   int wait_to_obtain_ms,
                                   int wait_to_release_ms)
 {
-    if (thread == NULL || mutex == NULL) {
+    if (mutex == NULL) {
         return false;
     }
  
-    struct thread_info *info = malloc(sizeof(struct thread_info));
-    if (info == NULL) {
+    return start_thread_obtaining_lock(thread, &thread_lock_pthread_mutex, mutex,
+                                       wait_to_obtain_ms, wait_to_release_ms);
+}
+ 
+/**
+ * Start a new thread like start_thread_obtaining_mutex(), locking
+ * @param lock through @param ops.
+ *
+ * Returns true if pthread_create succeeded, false otherwise.
+ */
+bool start_thread_obtaining_lock(pthread_t *thread,
+                                 const struct thread_lock_ops *ops,
+                                 void *lock,
+                                 int wait_to_obtain_ms,
+                                 int wait_to_release_ms)
+{
+    if (thread == NULL || ops == NULL || lock == NULL) {
         return false;
     }
  
-    info->pub.thread_complete_success = false;
-    info->mutex              = mutex;
-    info->wait_to_obtain_ms  = wait_to_obtain_ms;
-    info->wait_to_release_ms = wait_to_release_ms;
+    struct thread_info *info = thread_info_new(NULL, wait_to_obtain_ms,
+                                               wait_to_release_ms);
+    if (info == NULL) {
+        return false;
+    }
+    info->ops  = ops;
+    info->lock = lock;
  
     int rc = pthread_create(thread, NULL, threadfunc, info);
     if (rc != 0) {
@@ -108,3 +434,916 @@ bool start_thread_obtaining_mutex(pthread_t *thread,
     // because pub is the first struct member.
     return true;
 }
+ 
+/**
+ * Start a new thread like start_thread_obtaining_mutex(), with the
+ * obtain deadline and cancel token of @param options.
+ *
+ * Returns true if pthread_create succeeded, false otherwise, or without
+ * creating the thread if the obtain deadline is already out of reach.
+ */
+bool start_thread_obtaining_mutex_opts(pthread_t *thread,
+                                       pthread_mutex_t *mutex,
+                                       int wait_to_obtain_ms,
+                                       int wait_to_release_ms,
+                                       const struct thread_options *options)
+{
+    if (thread == NULL || mutex == NULL) {
+        return false;
+    }
+ 
+    struct thread_info *info = thread_info_new(mutex, wait_to_obtain_ms,
+                                               wait_to_release_ms);
+    if (info == NULL) {
+        return false;
+    }
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+    if (rc != 0) {
+        free(info);
+        errno = rc;
+        return false;
+    }
+    if (options != NULL) {
+        if (options->obtain_timeout_ms > 0) {
+            info->obtain_deadline_ns = info->start_ns +
+                                       options->obtain_timeout_ms * 1000000LL;
+        }
+        // Do not start a thread only to have it time out at once
+        if (info->obtain_deadline_ns >= 0 && wait_to_obtain_ms > options->obtain_timeout_ms) {
+            rc = ETIMEDOUT;
+        } else {
+            info->cancel = options->cancel;
+            rc = thread_attr_from_options(&attr, options);
+        }
+    }
+ 
+    if (rc == 0) {
+        rc = pthread_create(thread, &attr, threadfunc, info);
+    }
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        free(info);
+        errno = rc;
+        return false;
+    }
+    return true;
+}
+ 
+/**
+ * One thread of a thread_group and its operation.
+ */
+struct thread_group_slot {
+    pthread_t thread;
+    struct thread_info info;
+};
+ 
+struct thread_group {
+    int count;
+    struct thread_group_slot slots[];
+};
+ 
+/**
+ * Start @param count threads obtaining @param mutex, see
+ * start_threads_obtaining_mutex_batch() in threading.h.
+ */
+struct thread_group *start_threads_obtaining_mutex_batch(int count,
+                                                         pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms,
+                                                         int wait_to_release_ms,
+                                                         size_t stack_size)
+{
+    if (count <= 0 || mutex == NULL) {
+        return NULL;
+    }
+ 
+    // One allocation for the group and every descriptor
+    struct thread_group *group = malloc(sizeof(struct thread_group) +
+                                        count * sizeof(struct thread_group_slot));
+    if (group == NULL) {
+        return NULL;
+    }
+    group->count = 0;
+ 
+    if (stack_size == 0) {
+        stack_size = THREAD_BATCH_STACK_SIZE;
+    }
+    if (stack_size < (size_t)PTHREAD_STACK_MIN) {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0) {
+        free(group);
+        return NULL;
+    }
+    bool ok = pthread_attr_setstacksize(&attr, stack_size) == 0;
+ 
+    for (int i = 0; ok && i < count; i++) {
+        struct thread_group_slot *slot = &group->slots[i];
+        thread_info_init(&slot->info, mutex, wait_to_obtain_ms, wait_to_release_ms);
+        ok = pthread_create(&slot->thread, &attr, threadfunc, &slot->info) == 0;
+        if (ok) {
+            group->count++;
+        }
+    }
+    pthread_attr_destroy(&attr);
+ 
+    if (!ok) {
+        // The descriptors live in the group: wait for the threads using them
+        thread_group_join(group);
+        free(group);
+        return NULL;
+    }
+    return group;
+}
+ 
+/**
+ * Join every thread of @param group.
+ */
+int thread_group_join(struct thread_group *group)
+{
+    int succeeded = 0;
+    for (int i = 0; i < group->count; i++) {
+        struct thread_data *data = NULL;
+        if (pthread_join(group->slots[i].thread, (void **)&data) == 0 &&
+            data != NULL && data->thread_complete_success) {
+            succeeded++;
+        }
+    }
+    return succeeded;
+}
+ 
+/**
+ * Result of thread @param index of @param group.
+ */
+struct thread_data *thread_group_data(struct thread_group *group, int index)
+{
+    if (index < 0 || index >= group->count) {
+        return NULL;
+    }
+    return &group->slots[index].info.pub;
+}
+ 
+/**
+ * Free @param group and every descriptor in it.
+ */
+void thread_group_free(struct thread_group *group)
+{
+    free(group);
+}
+ 
+/**
+ * Worker thread of a thread_pool: runs queued tasks in FIFO order with
+ * threadfunc() until the pool shuts down and the queue is empty.
+ */
+static void *pool_worker(void *arg)
+{
+    struct thread_pool *pool = (struct thread_pool *)arg;
+ 
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            break;      // shutting down and nothing left to run
+        }
+ 
+        struct thread_info *info = pool->head;
+        pool->head = info->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+ 
+        threadfunc(info);
+ 
+        pthread_mutex_lock(&pool->lock);
+        info->done = true;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+ 
+    return NULL;
+}
+ 
+/**
+ * Create a pool of @param nthreads worker threads.
+ * Returns NULL on failure.
+ */
+struct thread_pool *thread_pool_create(int nthreads)
+{
+    if (nthreads <= 0) {
+        return NULL;
+    }
+ 
+    struct thread_pool *pool = malloc(sizeof(struct thread_pool) +
+                                      nthreads * sizeof(pthread_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+ 
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->shutdown = false;
+    pool->nthreads = 0;
+ 
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+ 
+    return pool;
+}
+ 
+/**
+ * Queue a delayed lock operation on @param pool, see
+ * start_pooled_thread_obtaining_mutex() in threading.h.
+ */
+bool start_pooled_thread_obtaining_mutex(struct thread_pool *pool,
+                                         struct thread_data **handle,
+                                         pthread_mutex_t *mutex,
+                                         int wait_to_obtain_ms,
+                                         int wait_to_release_ms)
+{
+    if (pool == NULL || handle == NULL || mutex == NULL) {
+        return false;
+    }
+ 
+    struct thread_info *info = thread_info_new(mutex, wait_to_obtain_ms,
+                                               wait_to_release_ms);
+    if (info == NULL) {
+        return false;
+    }
+ 
+    pthread_mutex_lock(&pool->lock);
+    if (pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        free(info);
+        return false;
+    }
+    if (pool->tail != NULL) {
+        pool->tail->next = info;
+    } else {
+        pool->head = info;
+    }
+    pool->tail = info;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+ 
+    *handle = &info->pub;
+    return true;
+}
+ 
+/**
+ * Wait for the task of @param handle to complete.
+ */
+struct thread_data *thread_pool_join(struct thread_pool *pool,
+                                     struct thread_data *handle)
+{
+    // pub is the first member, so the handle is the thread_info itself
+    struct thread_info *info = (struct thread_info *)handle;
+ 
+    pthread_mutex_lock(&pool->lock);
+    while (!info->done) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+ 
+    return handle;
+}
+ 
+/**
+ * Run the remaining queued tasks, stop the workers and free @param pool.
+ */
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+ 
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+ 
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+ 
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+ 
+/**
+ * Add @param info to the heap of @param shard.  Caller holds the shard lock.
+ * Returns false if the heap could not be grown.
+ */
+static bool sched_heap_push(struct sched_shard *shard, struct thread_info *info)
+{
+    if (shard->count == shard->capacity) {
+        size_t capacity = shard->capacity ? shard->capacity * 2 : 64;
+        struct thread_info **heap = realloc(shard->heap, capacity * sizeof(*heap));
+        if (heap == NULL) {
+            return false;
+        }
+        shard->heap = heap;
+        shard->capacity = capacity;
+    }
+ 
+    size_t i = shard->count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (shard->heap[parent]->deadline_ns <= info->deadline_ns) {
+            break;
+        }
+        shard->heap[i] = shard->heap[parent];
+        i = parent;
+    }
+    shard->heap[i] = info;
+    return true;
+}
+ 
+/**
+ * Remove and return the earliest operation of @param shard, whose heap
+ * must not be empty.  Caller holds the shard lock.
+ */
+static struct thread_info *sched_heap_pop(struct sched_shard *shard)
+{
+    struct thread_info *top = shard->heap[0];
+    struct thread_info *last = shard->heap[--shard->count];
+ 
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= shard->count) {
+            break;
+        }
+        if (child + 1 < shard->count &&
+            shard->heap[child + 1]->deadline_ns < shard->heap[child]->deadline_ns) {
+            child++;
+        }
+        if (last->deadline_ns <= shard->heap[child]->deadline_ns) {
+            break;
+        }
+        shard->heap[i] = shard->heap[child];
+        i = child;
+    }
+    if (shard->count > 0) {
+        shard->heap[i] = last;
+    }
+    return top;
+}
+ 
+static size_t sched_held_slot(const struct sched_shard *shard, const pthread_mutex_t *mutex)
+{
+    uint64_t key = (uintptr_t)mutex;
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (shard->held_capacity - 1);
+}
+ 
+/**
+ * Return the operation of @param shard holding @param mutex, if any.
+ */
+static struct thread_info *sched_held_find(struct sched_shard *shard, pthread_mutex_t *mutex)
+{
+    if (shard->held_count == 0) {
+        return NULL;
+    }
+ 
+    for (size_t i = sched_held_slot(shard, mutex); shard->held[i] != NULL;
+         i = (i + 1) & (shard->held_capacity - 1)) {
+        if (shard->held[i]->mutex == mutex) {
+            return shard->held[i];
+        }
+    }
+    return NULL;
+}
+ 
+/**
+ * Record @param info as the holder of its mutex.
+ * Returns false if the table could not be grown; the mutex is then only
+ * unknown to other operations, which poll for it.
+ */
+static bool sched_held_insert(struct sched_shard *shard, struct thread_info *info)
+{
+    if ((shard->held_count + 1) * 2 > shard->held_capacity) {
+        size_t capacity = shard->held_capacity ? shard->held_capacity * 2 : 64;
+        struct thread_info **old = shard->held;
+        size_t old_capacity = shard->held_capacity;
+        struct thread_info **held = calloc(capacity, sizeof(*held));
+        if (held == NULL) {
+            return false;
+        }
+        shard->held = held;
+        shard->held_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i] != NULL) {
+                size_t j = sched_held_slot(shard, old[i]->mutex);
+                while (held[j] != NULL) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                held[j] = old[i];
+            }
+        }
+        free(old);
+    }
+ 
+    size_t i = sched_held_slot(shard, info->mutex);
+    while (shard->held[i] != NULL) {
+        i = (i + 1) & (shard->held_capacity - 1);
+    }
+    shard->held[i] = info;
+    shard->held_count++;
+    return true;
+}
+ 
+/**
+ * Forget @param info as the holder of its mutex, if it was recorded.
+ */
+static void sched_held_remove(struct sched_shard *shard, struct thread_info *info)
+{
+    if (shard->held_count == 0) {
+        return;
+    }
+ 
+    size_t mask = shard->held_capacity - 1;
+    size_t i = sched_held_slot(shard, info->mutex);
+    while (shard->held[i] != info) {
+        if (shard->held[i] == NULL) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    shard->held_count--;
+ 
+    // Shift back later entries of the probe sequence into the hole
+    for (size_t j = (i + 1) & mask; shard->held[j] != NULL; j = (j + 1) & mask) {
+        size_t home = sched_held_slot(shard, shard->held[j]->mutex);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            shard->held[i] = shard->held[j];
+            i = j;
+        }
+    }
+    shard->held[i] = NULL;
+}
+ 
+/**
+ * Complete @param info, which gives up its mutex, and hand the mutex to
+ * the first operation parked behind it, along with the others.  The
+ * operation handed the mutex is requeued at @param now_ns.
+ */
+static void sched_hand_off(struct sched_shard *shard, struct thread_info *info,
+                           long long now_ns)
+{
+    sched_held_remove(shard, info);
+    info->done = true;
+ 
+    struct thread_info *next = info->waiters;
+    if (next != NULL) {
+        next->waiters = next->next;
+        next->waiters_tail = next->waiters ? info->waiters_tail : NULL;
+        next->deadline_ns = now_ns;
+        sched_heap_push(shard, next);
+    }
+}
+ 
+/**
+ * Run the step of @param info that is due at @param now_ns.
+ * Returns true if the operation has more steps, with its deadline updated,
+ * false if it completed or is parked in the waiters list of a holder.
+ * May requeue one parked operation, which reuses the heap slot of @param info.
+ */
+static bool sched_run_step(struct sched_shard *shard, struct thread_info *info,
+                           long long now_ns)
+{
+    if (info->step == SCHED_STEP_OBTAIN) {
+        long long obtain_deadline_ns = info->start_ns + info->wait_to_obtain_ms * 1000000LL;
+        if (info->pub.obtain_lateness_ns < 0) {
+            info->pub.obtain_lateness_ns = now_ns - obtain_deadline_ns;
+        }
+ 
+        struct thread_info *holder = sched_held_find(shard, info->mutex);
+        if (holder != NULL && holder != info) {
+            // Park behind the holder, followed by the operations parked behind us
+            info->next = info->waiters;
+            struct thread_info *tail = info->waiters ? info->waiters_tail : info;
+            info->waiters = NULL;
+            info->waiters_tail = NULL;
+            if (holder->waiters_tail != NULL) {
+                holder->waiters_tail->next = info;
+            } else {
+                holder->waiters = info;
+            }
+            holder->waiters_tail = tail;
+            return false;
+        }
+ 
+        if (holder == NULL) {
+            sched_held_insert(shard, info);
+        }
+ 
+        int rc = pthread_mutex_trylock(info->mutex);
+        if (rc == EBUSY) {
+            // Held outside the scheduler: poll again, backing off while it stays busy
+            info->deadline_ns = now_ns + info->retry_ns;
+            if (info->retry_ns < SCHED_RETRY_MAX_NS) {
+                info->retry_ns *= 2;
+            }
+            return true;
+        }
+        if (rc != 0) {
+            sched_hand_off(shard, info, now_ns);
+            return false;   // failure, keep thread_complete_success = false
+        }
+        info->pub.lock_wait_ns = now_ns - (obtain_deadline_ns + info->pub.obtain_lateness_ns);
+        info->step = SCHED_STEP_RELEASE;
+        info->deadline_ns = now_ns + info->wait_to_release_ms * 1000000LL;
+        return true;
+    }
+ 
+    // SCHED_STEP_RELEASE: we locked the mutex on this very thread
+    info->pub.release_lateness_ns = now_ns - info->deadline_ns;
+    info->pub.thread_complete_success = (pthread_mutex_unlock(info->mutex) == 0);
+    sched_hand_off(shard, info, now_ns);
+    return false;
+}
+ 
+/**
+ * Timer thread of a sched_shard: sleeps until the earliest deadline, runs
+ * every step that is due and requeues the operations that continue.
+ * Exits once shutting down with no operation left.
+ */
+static void *sched_worker(void *arg)
+{
+    struct sched_shard *shard = (struct sched_shard *)arg;
+ 
+    pthread_mutex_lock(&shard->lock);
+    for (;;) {
+        if (shard->count == 0) {
+            if (shard->shutdown) {
+                break;
+            }
+            pthread_cond_wait(&shard->cond, &shard->lock);
+            continue;
+        }
+ 
+        long long now_ns = monotonic_ns();
+        long long deadline_ns = shard->heap[0]->deadline_ns;
+        if (deadline_ns > now_ns) {
+            struct timespec ts = {
+                .tv_sec = deadline_ns / 1000000000LL,
+                .tv_nsec = deadline_ns % 1000000000LL,
+            };
+            pthread_cond_timedwait(&shard->cond, &shard->lock, &ts);
+            continue;
+        }
+ 
+        // The steps never block: they only trylock or unlock
+        // Heap pushes cannot fail here, they reuse the slot just popped
+        struct thread_info *info = sched_heap_pop(shard);
+        if (sched_run_step(shard, info, now_ns)) {
+            sched_heap_push(shard, info);
+        } else if (info->done) {
+            pthread_cond_broadcast(&shard->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+ 
+    return NULL;
+}
+ 
+/**
+ * All steps of the operations on one mutex run on the same shard, so the
+ * thread that unlocks a mutex is always the one that locked it.
+ */
+static struct sched_shard *sched_shard_for(struct lock_scheduler *sched,
+                                           pthread_mutex_t *mutex)
+{
+    uintptr_t key = (uintptr_t)mutex / sizeof(pthread_mutex_t);
+    return &sched->shards[key % (uintptr_t)sched->nshards];
+}
+ 
+/**
+ * Create a scheduler with @param nthreads timer threads.
+ * Returns NULL on failure.
+ */
+struct lock_scheduler *lock_scheduler_create(int nthreads)
+{
+    if (nthreads <= 0) {
+        return NULL;
+    }
+ 
+    struct lock_scheduler *sched = malloc(sizeof(struct lock_scheduler) +
+                                          nthreads * sizeof(struct sched_shard));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->nshards = nthreads;
+ 
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < nthreads; i++) {
+        struct sched_shard *shard = &sched->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->cond, &attr);
+        pthread_cond_init(&shard->done_cond, NULL);
+        shard->heap = NULL;
+        shard->count = 0;
+        shard->capacity = 0;
+        shard->held = NULL;
+        shard->held_count = 0;
+        shard->held_capacity = 0;
+        shard->shutdown = false;
+        shard->started = false;
+    }
+    pthread_condattr_destroy(&attr);
+ 
+    for (int i = 0; i < nthreads; i++) {
+        struct sched_shard *shard = &sched->shards[i];
+        if (pthread_create(&shard->thread, NULL, sched_worker, shard) != 0) {
+            lock_scheduler_destroy(sched);
+            return NULL;
+        }
+        shard->started = true;
+    }
+ 
+    return sched;
+}
+ 
+/**
+ * Schedule a delayed lock operation on @param sched, see
+ * schedule_obtaining_mutex() in threading.h.
+ */
+bool schedule_obtaining_mutex(struct lock_scheduler *sched, struct thread_data **handle,
+                              pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                              int wait_to_release_ms)
+{
+    if (sched == NULL || handle == NULL || mutex == NULL) {
+        return false;
+    }
+ 
+    struct thread_info *info = thread_info_new(mutex, wait_to_obtain_ms,
+                                               wait_to_release_ms);
+    if (info == NULL) {
+        return false;
+    }
+    info->step = SCHED_STEP_OBTAIN;
+    info->retry_ns = SCHED_RETRY_MIN_NS;
+    info->deadline_ns = info->start_ns + wait_to_obtain_ms * 1000000LL;
+ 
+    struct sched_shard *shard = sched_shard_for(sched, mutex);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->shutdown || !sched_heap_push(shard, info)) {
+        pthread_mutex_unlock(&shard->lock);
+        free(info);
+        return false;
+    }
+    if (shard->heap[0] == info) {
+        // New earliest deadline: the timer thread may sleep past it
+        pthread_cond_signal(&shard->cond);
+    }
+    pthread_mutex_unlock(&shard->lock);
+ 
+    *handle = &info->pub;
+    return true;
+}
+ 
+/**
+ * Wait for the operation of @param handle to complete.
+ */
+struct thread_data *lock_scheduler_join(struct lock_scheduler *sched,
+                                        struct thread_data *handle)
+{
+    struct thread_info *info = (struct thread_info *)handle;
+    struct sched_shard *shard = sched_shard_for(sched, info->mutex);
+ 
+    pthread_mutex_lock(&shard->lock);
+    while (!info->done) {
+        pthread_cond_wait(&shard->done_cond, &shard->lock);
+    }
+    pthread_mutex_unlock(&shard->lock);
+ 
+    return handle;
+}
+ 
+/**
+ * Wait for all scheduled operations, stop the timer threads and free
+ * @param sched.
+ */
+void lock_scheduler_destroy(struct lock_scheduler *sched)
+{
+    if (sched == NULL) {
+        return;
+    }
+ 
+    for (int i = 0; i < sched->nshards; i++) {
+        struct sched_shard *shard = &sched->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->shutdown = true;
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+ 
+    for (int i = 0; i < sched->nshards; i++) {
+        struct sched_shard *shard = &sched->shards[i];
+        if (shard->started) {
+            pthread_join(shard->thread, NULL);
+        }
+        free(shard->heap);
+        free(shard->held);
+        pthread_cond_destroy(&shard->done_cond);
+        pthread_cond_destroy(&shard->cond);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(sched);
+}
+ 
+/**
+ * Results of detached threads, see struct completion_queue in threading.h.
+ * Finished threads push onto a lock-free stack and signal the eventfd when
+ * the stack was empty; the single consumer takes the whole stack at once.
+ */
+struct completion_queue {
+    int efd;
+    _Atomic(struct thread_info *) completed;    // pushed by finished threads
+    struct thread_info *ready;                  // taken but not yet returned
+    pthread_mutex_t free_lock;
+    struct thread_info *free_list;              // recycled descriptors
+    pthread_attr_t attr;                        // detached, small stack
+    atomic_int running;                         // threads not past their signal yet
+};
+ 
+struct completion_queue *completion_queue_create(void)
+{
+    struct completion_queue *cq = malloc(sizeof(struct completion_queue));
+    if (cq == NULL) {
+        return NULL;
+    }
+ 
+    cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cq->efd == -1) {
+        free(cq);
+        return NULL;
+    }
+    atomic_init(&cq->completed, NULL);
+    cq->ready = NULL;
+    pthread_mutex_init(&cq->free_lock, NULL);
+    cq->free_list = NULL;
+    atomic_init(&cq->running, 0);
+ 
+    size_t stack_size = THREAD_BATCH_STACK_SIZE;
+    if (stack_size < (size_t)PTHREAD_STACK_MIN) {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+    pthread_attr_init(&cq->attr);
+    pthread_attr_setdetachstate(&cq->attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&cq->attr, stack_size);
+    return cq;
+}
+ 
+int completion_queue_fd(struct completion_queue *cq)
+{
+    return cq->efd;
+}
+ 
+/**
+ * Thread started by start_thread_obtaining_mutex_notify(): run the
+ * operation, then post it to its completion queue.
+ */
+static void *notify_threadfunc(void *thread_param)
+{
+    struct thread_info *info = (struct thread_info *)thread_param;
+    struct completion_queue *cq = info->cq;
+ 
+    threadfunc(info);
+ 
+    struct thread_info *head = atomic_load_explicit(&cq->completed, memory_order_relaxed);
+    do {
+        info->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&cq->completed, &head, info,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL) {
+        // The consumer may be asleep in poll(): one wakeup per batch is enough
+        uint64_t one = 1;
+        while (write(cq->efd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+    atomic_fetch_sub_explicit(&cq->running, 1, memory_order_release);
+    return NULL;
+}
+ 
+bool start_thread_obtaining_mutex_notify(struct completion_queue *cq,
+                                         pthread_mutex_t *mutex,
+                                         int wait_to_obtain_ms,
+                                         int wait_to_release_ms)
+{
+    if (cq == NULL || mutex == NULL) {
+        return false;
+    }
+ 
+    pthread_mutex_lock(&cq->free_lock);
+    struct thread_info *info = cq->free_list;
+    if (info != NULL) {
+        cq->free_list = info->next;
+    }
+    pthread_mutex_unlock(&cq->free_lock);
+    if (info == NULL) {
+        info = malloc(sizeof(struct thread_info));
+        if (info == NULL) {
+            return false;
+        }
+    }
+    thread_info_init(info, mutex, wait_to_obtain_ms, wait_to_release_ms);
+    info->cq = cq;
+ 
+    pthread_t thread;
+    atomic_fetch_add_explicit(&cq->running, 1, memory_order_relaxed);
+    if (pthread_create(&thread, &cq->attr, notify_threadfunc, info) != 0) {
+        atomic_fetch_sub_explicit(&cq->running, 1, memory_order_relaxed);
+        completion_queue_recycle(cq, (struct thread_data **)&info, 1);
+        return false;
+    }
+    return true;
+}
+ 
+size_t completion_queue_drain(struct completion_queue *cq, struct thread_data **results,
+                              size_t max)
+{
+    if (cq->ready == NULL) {
+        // Reset the eventfd before taking the stack, so a push after the
+        // exchange finds it empty and signals again
+        uint64_t count;
+        while (read(cq->efd, &count, sizeof(count)) == -1 && errno == EINTR) {
+        }
+        cq->ready = atomic_exchange_explicit(&cq->completed, NULL, memory_order_acquire);
+    }
+ 
+    size_t n = 0;
+    while (n < max && cq->ready != NULL) {
+        struct thread_info *info = cq->ready;
+        cq->ready = info->next;
+        results[n++] = &info->pub;
+    }
+    return n;
+}
+ 
+void completion_queue_recycle(struct completion_queue *cq, struct thread_data **results,
+                              size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+ 
+    // Chain the batch first, then splice it in under the lock once
+    struct thread_info *first = (struct thread_info *)results[0];
+    struct thread_info *last = first;
+    for (size_t i = 1; i < count; i++) {
+        last->next = (struct thread_info *)results[i];
+        last = last->next;
+    }
+ 
+    pthread_mutex_lock(&cq->free_lock);
+    last->next = cq->free_list;
+    cq->free_list = first;
+    pthread_mutex_unlock(&cq->free_lock);
+}
+ 
+void completion_queue_destroy(struct completion_queue *cq)
+{
+    if (cq == NULL) {
+        return;
+    }
+ 
+    // A thread whose result was drained may still be signalling the eventfd
+    while (atomic_load_explicit(&cq->running, memory_order_acquire) != 0) {
+        sched_yield();
+    }
+ 
+    struct thread_info *lists[] = {
+        cq->ready,
+        atomic_load(&cq->completed),
+        cq->free_list,
+    };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        while (lists[i] != NULL) {
+            struct thread_info *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+ 
+    pthread_attr_destroy(&cq->attr);
+    pthread_mutex_destroy(&cq->free_lock);
+    close(cq->efd);
+    free(cq);
+}
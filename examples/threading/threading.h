@@ -1,6 +1,22 @@
+#ifndef THREADING_H
+#define THREADING_H
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <sched.h>
 #include <pthread.h>
 
+/**
+ * How a delayed lock operation ended, see thread_data.outcome.
+ */
+enum thread_outcome {
+    THREAD_OUTCOME_PENDING = 0,     // not finished yet
+    THREAD_OUTCOME_COMPLETED,       // obtained and released the lock
+    THREAD_OUTCOME_TIMED_OUT,       // could not obtain the lock before its deadline
+    THREAD_OUTCOME_CANCELLED,       // cancelled before trying to obtain the lock
+    THREAD_OUTCOME_FAILED,          // locking or unlocking returned an error
+};
+
 /**
  * This structure should be dynamically allocated and passed as
  * an argument to your thread using pthread_create.
@@ -20,6 +36,22 @@ struct thread_data{
      * if an error occurred.
      */
     bool thread_complete_success;
+
+    /**
+     * Why the operation ended; thread_complete_success is true only for
+     * THREAD_OUTCOME_COMPLETED.
+     */
+    enum thread_outcome outcome;
+
+    /**
+     * Timing of the operation in nanoseconds, -1 for steps that did not happen:
+     * how late the thread woke up to obtain the mutex (relative to wait_to_obtain_ms
+     * after the request), how long it then waited for the mutex, and how late it woke
+     * up to release it (relative to wait_to_release_ms after obtaining it).
+     */
+    long long obtain_lateness_ns;
+    long long lock_wait_ns;
+    long long release_lateness_ns;
 };
 
 
@@ -38,3 +70,282 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * How threadfunc() obtains and releases a lock, so the delayed lock operations can use other
+ * lock types than pthread_mutex_t.  The functions return 0 on success, like the pthread ones.
+ * timedlock gives up with ETIMEDOUT once CLOCK_MONOTONIC reaches deadline_ns; it is optional,
+ * without it a deadline is only checked before locking.
+ */
+struct thread_lock_ops {
+    const char *name;
+    int (*lock)(void *lock);
+    int (*unlock)(void *lock);
+    int (*timedlock)(void *lock, long long deadline_ns);
+};
+
+/**
+ * Operations for a pthread_mutex_t, used by start_thread_obtaining_mutex().
+ */
+extern const struct thread_lock_ops thread_lock_pthread_mutex;
+
+/**
+* Same as start_thread_obtaining_mutex(), for a lock of any type: @param lock is obtained and
+* released through @param ops.
+* @return true if the thread could be started, false if a failure occurred.
+*/
+bool start_thread_obtaining_lock(pthread_t *thread, const struct thread_lock_ops *ops, void *lock,
+                                 int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * Lets a caller cancel delayed lock operations that have not tried to obtain their lock yet.
+ * Operations waiting to obtain wake up at once and end with THREAD_OUTCOME_CANCELLED; one that
+ * already holds or waits for the lock is not interrupted.
+ */
+struct thread_cancel_token {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;            // on CLOCK_MONOTONIC
+    bool cancelled;
+};
+
+/**
+* Initialize @param token, not cancelled.
+* @return 0 on success, an error number otherwise.
+*/
+int thread_cancel_token_init(struct thread_cancel_token *token);
+
+/**
+* Cancel every operation using @param token that has not tried to obtain its lock yet, and any
+* started with it later.
+*/
+void thread_cancel(struct thread_cancel_token *token);
+
+/**
+* Destroy @param token, once no operation uses it any more.
+*/
+void thread_cancel_token_destroy(struct thread_cancel_token *token);
+
+/**
+ * Optional limits of a delayed lock operation.
+ */
+struct thread_options {
+    /**
+     * Give up obtaining the lock this many milliseconds after the request, 0 for no limit.
+     * An operation whose wait_to_obtain_ms is already past it is not started at all.
+     */
+    int obtain_timeout_ms;
+
+    /**
+     * Token to cancel the operation with, NULL if it cannot be cancelled.
+     */
+    struct thread_cancel_token *cancel;
+
+    /**
+     * Scheduling policy of the thread, SCHED_FIFO or SCHED_RR with sched_priority, or
+     * SCHED_OTHER (0) to inherit the policy of the caller.  Real-time policies need
+     * CAP_SYS_NICE or an RLIMIT_RTPRIO allowing the priority.
+     */
+    int sched_policy;
+    int sched_priority;
+
+    /**
+     * CPUs the thread may run on, NULL for any: a cpu_set_t, or a set from CPU_ALLOC() for
+     * more than CPU_SETSIZE CPUs with its size in cpu_set_size (0 for sizeof(cpu_set_t)).
+     * Untyped so the struct is the same whether or not <sched.h> declares cpu_set_t, which
+     * it only does with _GNU_SOURCE.
+     */
+    const void *cpu_set;
+    size_t cpu_set_size;
+};
+
+/**
+* Same as start_thread_obtaining_mutex(), within the limits of @param options (none if NULL).
+* The outcome of the thread_data tells whether the operation completed, timed out or was
+* cancelled.
+* Options left 0, as in a zero-initialized struct thread_options, set no limit.
+* @return true if the thread could be started, false if a failure occurred, with errno set to
+* the error of pthread_create() (EPERM when a real-time policy is not allowed), or to ETIMEDOUT
+* without starting a thread when wait_to_obtain_ms is past the obtain timeout.
+*/
+bool start_thread_obtaining_mutex_opts(pthread_t *thread, pthread_mutex_t *mutex,
+                                       int wait_to_obtain_ms, int wait_to_release_ms,
+                                       const struct thread_options *options);
+
+/**
+* Initialize @param mutex with the priority inheritance protocol: while a thread waits for it,
+* the owner runs at least at the waiter's priority, so a thread of medium priority cannot delay
+* a high priority waiter by preempting a low priority owner.
+* @return 0 on success, an error number otherwise.
+*/
+int thread_mutex_init_pi(pthread_mutex_t *mutex);
+
+/**
+ * Threads started together by start_threads_obtaining_mutex_batch(), with their thread_data
+ * records, in a single allocation.
+ */
+struct thread_group;
+
+#define THREAD_BATCH_STACK_SIZE (64 * 1024)
+
+/**
+* Start @param count threads which each behave like one started by
+* start_thread_obtaining_mutex(@param mutex, @param wait_to_obtain_ms, @param wait_to_release_ms).
+* All their records are allocated at once, and the threads get stacks of @param stack_size bytes
+* (THREAD_BATCH_STACK_SIZE if 0) instead of the default of usually 8 MiB, so many more of them
+* fit in memory.
+* If a thread cannot be started, the ones already running are joined, which blocks until they
+* complete, and NULL is returned.
+* @return the group handle, to be passed to thread_group_join() and then thread_group_free().
+*/
+struct thread_group *start_threads_obtaining_mutex_batch(int count, pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms,
+                                                         int wait_to_release_ms,
+                                                         size_t stack_size);
+
+/**
+* Wait for every thread of @param group.
+* @return the number of threads whose thread_complete_success is true.
+*/
+int thread_group_join(struct thread_group *group);
+
+/**
+* @return the thread_data of thread @param index of @param group, NULL if out of range.  It
+* belongs to the group and must not be freed on its own.
+*/
+struct thread_data *thread_group_data(struct thread_group *group, int index);
+
+/**
+* Free @param group, after thread_group_join().
+*/
+void thread_group_free(struct thread_group *group);
+
+/**
+ * Collects the results of detached delayed lock threads, so a supervisor can wait for thousands
+ * of them with one poll() instead of joining each thread, and reuse their memory in bulk.
+ * Results are consumed by a single thread.
+ */
+struct completion_queue;
+
+/**
+* @return a new completion queue, or NULL on failure.
+*/
+struct completion_queue *completion_queue_create(void);
+
+/**
+* @return an eventfd that becomes readable (POLLIN) when completed results are waiting.
+*/
+int completion_queue_fd(struct completion_queue *cq);
+
+/**
+* Like start_thread_obtaining_mutex(), but the thread is detached and posts its thread_data to
+* @param cq when it is done.  Records recycled to @param cq are reused.
+* @return true if the thread could be started, false if a failure occurred.
+*/
+bool start_thread_obtaining_mutex_notify(struct completion_queue *cq, pthread_mutex_t *mutex,
+                                         int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Take up to @param max completed results of @param cq into @param results, without blocking.
+* Results left over when @param max is reached are returned by the next call even if the fd is
+* not readable, so call until fewer than @param max are returned before polling again.
+* @return the number of results stored.
+*/
+size_t completion_queue_drain(struct completion_queue *cq, struct thread_data **results,
+                              size_t max);
+
+/**
+* Give @param count results back to @param cq for reuse by later threads, instead of freeing
+* each one.
+*/
+void completion_queue_recycle(struct completion_queue *cq, struct thread_data **results,
+                              size_t count);
+
+/**
+* Free @param cq with all results it still holds.  Every thread started on it must have
+* completed, i.e. all its results must have been drained.
+*/
+void completion_queue_destroy(struct completion_queue *cq);
+
+/**
+ * A fixed set of persistent worker threads serving a FIFO queue of delayed
+ * lock operations, for callers that start many of them and do not want to
+ * pay thread creation and teardown for each one.
+ */
+struct thread_pool;
+
+/**
+* Create a pool of @param nthreads worker threads.
+* @return the pool, or NULL if the threads could not be started.
+*/
+struct thread_pool *thread_pool_create(int nthreads);
+
+/**
+* Pool-backed variant of start_thread_obtaining_mutex(): queue an operation which sleeps
+* @param wait_to_obtain_ms milliseconds, obtains @param mutex, holds it for @param wait_to_release_ms
+* milliseconds and releases it, then returns without blocking.
+* Each operation occupies a worker for its whole duration, so at most as many operations as the
+* pool has threads are in progress at any time; the rest wait in the queue.
+* On success @param handle is set to the thread_data of the operation, to be passed to
+* thread_pool_join().
+* @return true if the operation was queued, false if a failure occurred.
+*/
+bool start_pooled_thread_obtaining_mutex(struct thread_pool *pool, struct thread_data **handle,
+                                         pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                                         int wait_to_release_ms);
+
+/**
+* Wait for the operation of @param handle to complete, like pthread_join() does for the thread of
+* start_thread_obtaining_mutex().
+* @return @param handle, whose thread_complete_success holds the result; the caller frees it.
+*/
+struct thread_data *thread_pool_join(struct thread_pool *pool, struct thread_data *handle);
+
+/**
+* Run the operations still queued on @param pool, stop its threads and free it.
+* Every handle must be joined before the pool is destroyed.
+*/
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * Runs delayed lock operations as timer events on a few threads instead of
+ * parking one thread per operation in a sleep, so pending operations only
+ * cost their descriptor.  Each timer thread keeps a min-heap of the next
+ * step (obtain or release) of its operations.
+ */
+struct lock_scheduler;
+
+/**
+* Create a scheduler with @param nthreads timer threads.
+* @return the scheduler, or NULL if the threads could not be started.
+*/
+struct lock_scheduler *lock_scheduler_create(int nthreads);
+
+/**
+* Timer-driven variant of start_thread_obtaining_mutex(): after @param wait_to_obtain_ms
+* milliseconds obtain @param mutex, hold it for @param wait_to_release_ms milliseconds, then
+* release it.  Returns without blocking.
+* All operations on one mutex run on the same timer thread: one that finds the mutex held by
+* another operation waits for it to be handed over on release.  A mutex held outside the
+* scheduler is polled with pthread_mutex_trylock(), backing off from 50us up to 5ms, so it is
+* obtained slightly after it is released.  Recursive mutexes are not supported.
+* On success @param handle is set to the thread_data of the operation, to be passed to
+* lock_scheduler_join().
+* @return true if the operation was scheduled, false if a failure occurred.
+*/
+bool schedule_obtaining_mutex(struct lock_scheduler *sched, struct thread_data **handle,
+                              pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                              int wait_to_release_ms);
+
+/**
+* Wait for the operation of @param handle to complete.
+* @return @param handle, whose thread_complete_success holds the result; the caller frees it.
+*/
+struct thread_data *lock_scheduler_join(struct lock_scheduler *sched, struct thread_data *handle);
+
+/**
+* Wait for every scheduled operation to complete, stop the timer threads and free @param sched.
+* Every handle must be joined before the scheduler is destroyed.
+*/
+void lock_scheduler_destroy(struct lock_scheduler *sched);
+
+#endif /* THREADING_H */
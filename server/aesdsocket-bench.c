@@ -0,0 +1,438 @@
+/**
+ * aesdsocket-bench.c
+ *
+ * Load generator for aesdsocket, used to compare the work-stealing pool
+ * against the thread-per-connection mode (aesdsocket -t):
+ *
+ *   ./aesdsocket -w 4 &          (or: ./aesdsocket -t &)
+ *   ./aesdsocket-bench -c 32 -n 200 -b 2 -l 20000
+ *
+ *  - -c light clients identify themselves, then send -n packets of -s bytes
+ *    each and measure the time until their packet is echoed back; they only
+ *    receive records they have not seen, so their replies stay small
+ *  - -b bulk clients stay anonymous and keep downloading the whole file,
+ *    which is first grown by -l preload records; with -B they connect to
+ *    the server's bulk class port (aesdsocket -b) instead
+ *
+ * Prints one line of "key=value" pairs with the latency percentiles of the
+ * light clients and the overall packet throughput.  With -S the server's
+ * AESD_STATS counters are read before and after the run and the packets
+ * answered meanwhile are added; against a server built with
+ * "make ALLOC_STATS=1" so are its heap allocations per packet and peak heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT 9000
+
+static const char *host = "127.0.0.1";
+static int port = DEFAULT_PORT;
+static int bulk_port = 0;
+static int nclients = 8;
+static int npackets = 100;
+static int packet_len = 64;
+static int nbulk = 0;
+static int npreload = 0;
+static int server_stats = 0;
+
+static volatile int bulk_stop = 0;
+
+struct client {
+    pthread_t thread;
+    int index;
+    long *latencies_ns;         // npackets entries
+    int completed;
+};
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int connect_server(int to_port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(to_port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid address %s\n", host);
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t s = send(fd, buf, len, 0);
+        if (s < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += s;
+        len -= s;
+    }
+    return 0;
+}
+
+/**
+ * Read from @param fd until a line equal to @param line (including its
+ * '\n') has been received.  @param carry holds the unfinished last line
+ * between calls.
+ * Returns 0 once found, -1 on error or EOF.
+ */
+static int wait_for_line(int fd, const char *line, char *carry, size_t carry_cap,
+                         size_t *carry_len)
+{
+    size_t line_len = strlen(line);
+
+    for (;;) {
+        // Check complete lines in carry
+        char *p = carry;
+        char *end = carry + *carry_len;
+        char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            size_t len = nl - p + 1;
+            if (len == line_len && memcmp(p, line, len) == 0) {
+                p = nl + 1;
+                memmove(carry, p, end - p);
+                *carry_len = end - p;
+                return 0;
+            }
+            p = nl + 1;
+        }
+        memmove(carry, p, end - p);
+        *carry_len = end - p;
+        if (*carry_len == carry_cap) {
+            // Overlong foreign line, we cannot match inside it anyway
+            *carry_len = 0;
+        }
+
+        ssize_t r = recv(fd, carry + *carry_len, carry_cap - *carry_len, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *carry_len += r;
+    }
+}
+
+static void make_line(char *buf, size_t cap, const char *kind, int client, int seq)
+{
+    int n = snprintf(buf, cap, "%s-%d-%d-%d-", kind, (int)getpid(), client, seq);
+    while (n < packet_len - 1 && (size_t)n < cap - 2) {
+        buf[n++] = 'x';
+    }
+    buf[n++] = '\n';
+    buf[n] = '\0';
+}
+
+static void *light_client(void *arg)
+{
+    struct client *c = arg;
+    size_t cap = packet_len + 128;
+    char *line = malloc(cap);
+    size_t carry_cap = 64 * 1024;
+    char *carry = malloc(carry_cap);
+    size_t carry_len = 0;
+
+    int fd = connect_server(port);
+    if (fd == -1 || !line || !carry) {
+        goto out;
+    }
+
+    char hello[128];
+    snprintf(hello, sizeof(hello), "AESD_CLIENT:bench-%d-%d\n", (int)getpid(), c->index);
+    if (send_all(fd, hello, strlen(hello)) != 0) {
+        goto out;
+    }
+
+    for (int i = 0; i < npackets; i++) {
+        make_line(line, cap, "light", c->index, i);
+        long start = now_ns();
+        if (send_all(fd, line, strlen(line)) != 0 ||
+            wait_for_line(fd, line, carry, carry_cap, &carry_len) != 0) {
+            break;
+        }
+        c->latencies_ns[i] = now_ns() - start;
+        c->completed++;
+    }
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(line);
+    free(carry);
+    return NULL;
+}
+
+static void *bulk_client(void *arg)
+{
+    struct client *c = arg;
+    size_t cap = packet_len + 128;
+    char *line = malloc(cap);
+    size_t carry_cap = 64 * 1024;
+    char *carry = malloc(carry_cap);
+    size_t carry_len = 0;
+
+    int fd = connect_server(bulk_port ? bulk_port : port);
+    if (fd == -1 || !line || !carry) {
+        goto out;
+    }
+
+    for (int i = 0; !bulk_stop; i++) {
+        make_line(line, cap, "bulk", c->index, i);
+        if (send_all(fd, line, strlen(line)) != 0 ||
+            wait_for_line(fd, line, carry, carry_cap, &carry_len) != 0) {
+            break;
+        }
+        c->completed++;
+    }
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(line);
+    free(carry);
+    return NULL;
+}
+
+static int preload(void)
+{
+    int fd = connect_server(port);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char hello[128];
+    snprintf(hello, sizeof(hello), "AESD_CLIENT:bench-preload-%d\n", (int)getpid());
+    size_t cap = packet_len + 128;
+    char *line = malloc(cap);
+    size_t carry_cap = 64 * 1024;
+    char *carry = malloc(carry_cap);
+    size_t carry_len = 0;
+    int rc = (line && carry) ? send_all(fd, hello, strlen(hello)) : -1;
+
+    for (int i = 0; rc == 0 && i < npreload; i++) {
+        make_line(line, cap, "preload", 0, i);
+        rc = send_all(fd, line, strlen(line));
+        if (rc == 0 && (i == npreload - 1 || i % 256 == 255)) {
+            // Keep the server from buffering too far ahead of us
+            rc = wait_for_line(fd, line, carry, carry_cap, &carry_len);
+        }
+    }
+
+    free(line);
+    free(carry);
+    close(fd);
+    return rc;
+}
+
+/**
+ * Fetch the server statistics line into @param buf.
+ * Returns 0 on success, -1 on error.
+ */
+static int query_stats(char *buf, size_t cap)
+{
+    int fd = connect_server(port);
+    if (fd == -1) {
+        return -1;
+    }
+
+    size_t len = 0;
+    int rc = send_all(fd, "AESD_STATS\n", strlen("AESD_STATS\n"));
+    while (rc == 0 && !memchr(buf, '\n', len)) {
+        ssize_t r = recv(fd, buf + len, cap - 1 - len, 0);
+        if (r <= 0 || (size_t)r == cap - 1 - len) {
+            rc = -1;
+            break;
+        }
+        len += r;
+    }
+    buf[len] = '\0';
+    close(fd);
+    return rc;
+}
+
+/**
+ * Value of " @param key=<n>" in a statistics line, -1 if it is missing.
+ */
+static long long stat_value(const char *stats, const char *key)
+{
+    size_t key_len = strlen(key);
+    for (const char *p = strchr(stats, ' '); p; p = strchr(p + 1, ' ')) {
+        if (strncmp(p + 1, key, key_len) == 0 && p[1 + key_len] == '=') {
+            return atoll(p + 2 + key_len);
+        }
+    }
+    return -1;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c clients] [-n packets] [-s size]\n"
+            "          [-b bulk_clients] [-B bulk_port] [-l preload_records] [-S]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:s:b:B:l:S")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'n': npackets = atoi(optarg); break;
+        case 's': packet_len = atoi(optarg); break;
+        case 'b': nbulk = atoi(optarg); break;
+        case 'B': bulk_port = atoi(optarg); break;
+        case 'l': npreload = atoi(optarg); break;
+        case 'S': server_stats = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nclients < 1 || npackets < 1 || packet_len < 32 || nbulk < 0 || npreload < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (npreload > 0 && preload() != 0) {
+        fprintf(stderr, "preload failed\n");
+        return 1;
+    }
+
+    char stats_before[512];
+    if (server_stats && query_stats(stats_before, sizeof(stats_before)) != 0) {
+        fprintf(stderr, "server did not answer AESD_STATS\n");
+        return 1;
+    }
+
+    struct client *light = calloc(nclients, sizeof(*light));
+    struct client *bulk = calloc(nbulk ? nbulk : 1, sizeof(*bulk));
+    long *all = calloc((size_t)nclients * npackets, sizeof(long));
+    if (!light || !bulk || !all) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // Only the threads that started are stopped and joined
+    int bstarted = 0, lstarted = 0;
+    for (; bstarted < nbulk; bstarted++) {
+        bulk[bstarted].index = bstarted;
+        if (pthread_create(&bulk[bstarted].thread, NULL, bulk_client, &bulk[bstarted]) != 0) {
+            break;
+        }
+    }
+
+    long start = now_ns();
+    for (; bstarted == nbulk && lstarted < nclients; lstarted++) {
+        light[lstarted].index = lstarted;
+        light[lstarted].latencies_ns = all + (size_t)lstarted * npackets;
+        if (pthread_create(&light[lstarted].thread, NULL, light_client,
+                           &light[lstarted]) != 0) {
+            break;
+        }
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < lstarted; i++) {
+        pthread_join(light[i].thread, NULL);
+        // Compact the latencies of packets that completed
+        memmove(all + n, light[i].latencies_ns, light[i].completed * sizeof(long));
+        n += light[i].completed;
+    }
+    long elapsed = now_ns() - start;
+
+    bulk_stop = 1;
+    long bulk_replays = 0;
+    for (int i = 0; i < bstarted; i++) {
+        pthread_join(bulk[i].thread, NULL);
+        bulk_replays += bulk[i].completed;
+    }
+
+    if (bstarted != nbulk || lstarted != nclients) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+    }
+    if (n == 0) {
+        fprintf(stderr, "no packet completed\n");
+        return 1;
+    }
+
+    qsort(all, n, sizeof(long), cmp_long);
+    printf("clients=%d packets=%zu bulk=%d bulk_replays=%ld elapsed_ms=%.1f "
+           "throughput_pps=%.0f p50_us=%.1f p99_us=%.1f max_us=%.1f",
+           nclients, n, nbulk, bulk_replays, elapsed / 1e6,
+           n / (elapsed / 1e9),
+           all[n / 2] / 1e3, all[(n * 99) / 100] / 1e3, all[n - 1] / 1e3);
+
+    char stats_after[512];
+    if (server_stats && query_stats(stats_after, sizeof(stats_after)) == 0) {
+        long long packets = stat_value(stats_after, "packets") -
+                            stat_value(stats_before, "packets");
+        printf(" server_packets=%lld", packets);
+        if (stat_value(stats_after, "allocs") >= 0 && packets > 0) {
+            long long allocs = stat_value(stats_after, "allocs") +
+                               stat_value(stats_after, "reallocs") -
+                               stat_value(stats_before, "allocs") -
+                               stat_value(stats_before, "reallocs");
+            printf(" server_allocs_per_packet=%.3f server_packets_allocating=%lld"
+                   " server_heap_peak=%lld",
+                   (double)allocs / packets,
+                   stat_value(stats_after, "packets_allocating") -
+                   stat_value(stats_before, "packets_allocating"),
+                   stat_value(stats_after, "heap_peak"));
+        }
+    }
+    printf("\n");
+
+    free(light);
+    free(bulk);
+    free(all);
+    return 0;
+}
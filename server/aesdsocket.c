@@ -9,11 +9,36 @@
  *  - Runs in a loop until SIGINT or SIGTERM
  *  - On exit: logs message, closes socket, removes data file
  *  - Supports -d to run as a daemon (fork after bind/listen)
+ *  - A client may identify itself with "AESD_CLIENT:<id>\n"; the server then
+ *    answers "AESD_CURSOR:<gen>:<seq>\n" and keeps a cursor at the last
+ *    record the client acknowledged, either with "AESD_ACK:<gen>:<seq>\n" or
+ *    by adding the position of the last record it received to the handshake
+ *    ("AESD_CLIENT:<id> <gen>:<seq>\n"), so after reconnecting the client
+ *    only receives records after it.  <gen> is the generation of the data
+ *    file, which changes whenever the file starts over; positions from
+ *    another generation are ignored.  Cursors are kept in
+ *    /var/tmp/aesdsocketcursors across restarts
+ *  - Connections are serviced by a work-stealing thread pool fed from an
+ *    epoll loop, on non-blocking sockets so a client that does not read
+ *    never holds a worker; -t selects one thread per connection instead
+ *  - Connections are either interactive (default) or bulk, set by the
+ *    handshake ("AESD_CLIENT:<id> bulk") or by connecting to the port given
+ *    with -b.  In pool mode bulk connections and the tail of large replays
+ *    run at low priority, in chunks, behind packet ingestion and small replays
+ *  - SIGUSR1 samples all server threads for -P seconds (default 10) and
+ *    writes folded stacks for flame graphs to /var/tmp/aesdsocket.folded
+ *  - A connection whose first packet is "AESD_STATS\n" gets one line of
+ *    server statistics back; built with "make ALLOC_STATS=1" these include
+ *    heap allocation counters, and allocations and peak heap per connection
+ *    are logged
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,125 +48,1094 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "allocstats.h"
+#include "selfprof.h"
+#include "workpool.h"
 
 #define PORT 9000
 #define BACKLOG 10
 #define DATA_FILE "/var/tmp/aesdsocketdata"
+#define CURSOR_FILE "/var/tmp/aesdsocketcursors"
+#define PROFILE_FILE "/var/tmp/aesdsocket.folded"
+#define PROFILE_SECONDS 10
+
+#define CLIENT_ID_CMD "AESD_CLIENT:"
+#define ACK_CMD "AESD_ACK:"
+#define CURSOR_REPLY "AESD_CURSOR:"
+#define STATS_CMD "AESD_STATS\n"
+#define CLIENT_ID_MAX 64
+#define CLASS_BULK "bulk"
+#define CLASS_INTERACTIVE "interactive"
+#define MAX_CLIENT_CURSORS 256
+
+/**
+ * Replay cursor of an identified client: number of records (newline
+ * terminated packets) of DATA_FILE it acknowledged, and the file offset
+ * just past them so a replay can start there without rescanning.
+ * When the table is full, the cursor used least recently by a client that
+ * is not connected makes room for a new one.
+ */
+struct client_cursor {
+    char id[CLIENT_ID_MAX];
+    unsigned long seq;
+    off_t offset;
+    time_t last_used;       // last handshake or acknowledgement
+    int users;              // connections of the client
+};
+
+static struct client_cursor cursors[MAX_CLIENT_CURSORS];
+static size_t cursor_count = 0;
+
+/**
+ * Generation of DATA_FILE, saved with the cursors.  A new one is drawn
+ * whenever the file starts over empty, so record numbers a client learned
+ * from an earlier file are never taken for records of the current one.
+ * Set before any connection is accepted and constant afterwards.
+ */
+static unsigned long long data_generation = 0;
+
+#define MAX_EVENTS 64
+#define MAX_READS_PER_TASK 16
+#define MAX_LISTENERS 2
+#define REPLAY_CHUNK (64 * 1024)   // bytes sent per replay task in pool mode
+#define REPLAY_BUF_SIZE (16 * 1024)
+#define RECV_MIN 1024                   // free packet_buf space for each recv()
+#define PACKET_BUF_INITIAL 4096
+
+/**
+ * Guards appends to DATA_FILE, data_size and the cursor table.
+ * Replays only hold it long enough to snapshot data_size: the file is
+ * append-only, so everything below that size stays valid while it is sent.
+ */
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
+static off_t data_size = 0;
+
+/**
+ * Progress of sending DATA_FILE to one client.  A replay may be sent in
+ * several steps; it always stops at the data size seen when it started.
+ */
+struct replay {
+    off_t offset;               // next byte of DATA_FILE to read
+    off_t limit;                // data_size when the replay started
+    unsigned long records;      // records before offset
+};
+
+/**
+ * Per-connection state.  In pool mode at most one task per connection is
+ * queued or running at any time, which keeps its packets in order; between
+ * tasks the connection sits in the epoll set armed with EPOLLONESHOT, for
+ * EPOLLOUT while a replay waits for the client to read.
+ */
+struct connection {
+    struct workpool_task task;      // must stay valid while queued
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+
+    char *packet_buf;               // partial/complete packets, grown but never shrunk
+    size_t packet_cap;              // allocated size of packet_buf
+    size_t packet_size;             // bytes currently stored in packet_buf
+    size_t packet_start;            // bytes of packet_buf already consumed
+
+    struct client_cursor *cursor;   // set once the client identifies
+    unsigned long sent_seq;         // records sent to the identified client,
+    off_t sent_offset;              // ... and the offset just past them
+    int first_packet;
+    int eof;                        // peer closed or receive failed
+
+    enum workpool_priority priority;    // WORKPOOL_PRIO_LOW for bulk clients
+    struct replay replay;               // replay in progress (pool mode)
+    int replaying;
+
+#ifdef AESD_ALLOC_STATS
+    struct alloc_stats allocs;          // made while servicing this connection
+    unsigned long packets;              // packets answered
+    unsigned long packets_allocating;   // ... of which allocated memory
+    unsigned long packet_mark;          // allocs + reallocs when the packet began
+#endif
+
+    struct connection *prev;        // registry links, guarded by conn_lock
+    struct connection *next;
+};
+
+/**
+ * Charge heap allocations of the calling thread to @param conn until the
+ * scope is left.  The scope must be left before the connection is handed
+ * to another thread or freed.
+ */
+#ifdef AESD_ALLOC_STATS
+#define ALLOC_SCOPE_ENTER(conn) (alloc_stats_scope = &(conn)->allocs)
+#define ALLOC_SCOPE_LEAVE() (alloc_stats_scope = NULL)
+#else
+#define ALLOC_SCOPE_ENTER(conn) ((void)0)
+#define ALLOC_SCOPE_LEAVE() ((void)0)
+#endif
+
+// Server statistics reported by STATS_CMD
+static atomic_ulong stat_connections;
+static atomic_ulong stat_packets;
+#ifdef AESD_ALLOC_STATS
+static atomic_ulong stat_packets_allocating;
+static atomic_ulong stat_packet_allocs_max;
+static atomic_llong stat_conn_heap_peak_max;    // largest heap_peak of a closed connection
+#endif
+
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;   // registry emptied
+static struct connection *connections = NULL;
+
+/**
+ * A listening socket; connections accepted on it start in its class.
+ */
+struct listener {
+    int fd;
+    enum workpool_priority priority;
+};
+
+static struct listener listeners[MAX_LISTENERS];
+static int listener_count = 0;
+
+static struct workpool *pool = NULL;
+static int epoll_fd = -1;
 
 static volatile sig_atomic_t exit_requested = 0;
+static volatile sig_atomic_t profile_requested = 0;
+static unsigned int profile_seconds = PROFILE_SECONDS;
+
+/**
+ * Signal handler: just set a flag.
+ */
+static void signal_handler(int signo)
+{
+    if (signo == SIGINT || signo == SIGTERM) {
+        exit_requested = 1;
+    } else if (signo == SIGUSR1) {
+        profile_requested = 1;
+    }
+}
+
+/**
+ * Start the profiler if SIGUSR1 arrived since the last call.
+ */
+static void check_profile_request(void)
+{
+    if (profile_requested) {
+        profile_requested = 0;
+        // Errors logged in selfprof_start()
+        selfprof_start(profile_seconds, PROFILE_FILE);
+    }
+}
+
+/**
+ * Append a buffer to DATA_FILE, creating it if necessary.
+ * Caller holds data_lock.
+ * Returns 0 on success, -1 on error.
+ */
+static int append_to_file(const char *data, size_t len)
+{
+    int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "open(\"%s\") failed: %s", DATA_FILE, strerror(errno));
+        return -1;
+    }
+
+    ssize_t written = 0;
+    while (written < (ssize_t)len) {
+        ssize_t w = write(fd, data + written, len - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "write(\"%s\") failed: %s", DATA_FILE, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += w;
+    }
+    data_size += written;
+
+    if (close(fd) == -1) {
+        syslog(LOG_ERR, "close data file failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write @param len bytes to @param fd, retrying short writes.
+ * Returns 0 on success, -1 on error.
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/**
+ * Write the data generation and all replay cursors to CURSOR_FILE.
+ * Caller holds data_lock.
+ * The table is written to a temporary file first and renamed over the old
+ * one, so a crash never leaves a truncated cursor file behind.  This runs
+ * after every acknowledgement from an identified client, so it formats
+ * into a stack buffer rather than going through stdio, which would
+ * allocate a FILE and its buffer each time.
+ * Returns 0 on success, -1 on error.
+ */
+static int save_cursors(void)
+{
+    const char *tmp_path = CURSOR_FILE ".tmp";
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "open(\"%s\") failed: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    char buf[4096];
+    size_t used = snprintf(buf, sizeof(buf), "generation %llu\n", data_generation);
+    int rc = 0;
+    for (size_t i = 0; i < cursor_count && rc == 0; i++) {
+        // seq, offset, last_used, id and separators always fit in 160 bytes
+        if (sizeof(buf) - used < 160) {
+            rc = write_all(fd, buf, used);
+            used = 0;
+        }
+        used += snprintf(buf + used, sizeof(buf) - used, "%lu %lld %lld %s\n", cursors[i].seq,
+                         (long long)cursors[i].offset, (long long)cursors[i].last_used,
+                         cursors[i].id);
+    }
+    if (rc == 0) {
+        rc = write_all(fd, buf, used);
+    }
+
+    if (close(fd) == -1) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        syslog(LOG_ERR, "write(\"%s\") failed: %s", tmp_path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, CURSOR_FILE) == -1) {
+        syslog(LOG_ERR, "rename(\"%s\") failed: %s", tmp_path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Draw a generation for a DATA_FILE that starts over.
+ */
+static unsigned long long new_generation(void)
+{
+    unsigned long long generation;
+    if (getrandom(&generation, sizeof(generation), GRND_NONBLOCK) != sizeof(generation)) {
+        generation = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid();
+    }
+    return generation;
+}
+
+/**
+ * Load the data generation and replay cursors saved by a previous run.
+ * CURSOR_FILE holds a "generation <gen>" line followed by one
+ * "<seq> <offset> <last_used> <id>" line per cursor.  Cursors only carry over if
+ * DATA_FILE is still the file they were saved for: it is not empty (the
+ * file is removed on exit unless run as a daemon) and holds every record
+ * they count.  Otherwise the file starts a new generation without them.
+ * Caller has set data_size.
+ */
+static void load_cursors(void)
+{
+    FILE *fp = data_size > 0 ? fopen(CURSOR_FILE, "r") : NULL;
+    if (!fp && data_size > 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "fopen(\"%s\") failed: %s", CURSOR_FILE, strerror(errno));
+    }
+
+    if (fp && fscanf(fp, "generation %llu", &data_generation) == 1) {
+        unsigned long seq;
+        long long offset;
+        long long last_used;
+        char id[CLIENT_ID_MAX];
+        while (cursor_count < MAX_CLIENT_CURSORS &&
+               fscanf(fp, "%lu %lld %lld %63s", &seq, &offset, &last_used, id) == 4) {
+            if (offset > data_size) {
+                continue;
+            }
+            strcpy(cursors[cursor_count].id, id);
+            cursors[cursor_count].seq = seq;
+            cursors[cursor_count].offset = offset;
+            cursors[cursor_count].last_used = last_used;
+            cursor_count++;
+        }
+    } else {
+        data_generation = new_generation();
+        syslog(LOG_INFO, "Data file generation %llu", data_generation);
+        pthread_mutex_lock(&data_lock);
+        save_cursors();   // errors logged in save_cursors()
+        pthread_mutex_unlock(&data_lock);
+    }
+
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+/**
+ * Find the cursor for client @param id, creating it (at sequence 0) if it
+ * does not exist yet, and count a connection using it until put_cursor().
+ * Caller holds data_lock.
+ * Returns NULL if the cursor table is full of connected clients.
+ */
+static struct client_cursor *get_cursor(const char *id)
+{
+    struct client_cursor *cursor = NULL;
+    for (size_t i = 0; i < cursor_count && !cursor; i++) {
+        if (strcmp(cursors[i].id, id) == 0) {
+            cursor = &cursors[i];
+        }
+    }
+
+    if (!cursor && cursor_count < MAX_CLIENT_CURSORS) {
+        cursor = &cursors[cursor_count++];
+    } else if (!cursor) {
+        // Evict the least recently used cursor of a disconnected client
+        for (size_t i = 0; i < cursor_count; i++) {
+            if (cursors[i].users == 0 &&
+                (!cursor || cursors[i].last_used < cursor->last_used)) {
+                cursor = &cursors[i];
+            }
+        }
+        if (!cursor) {
+            syslog(LOG_ERR, "Cursor table full, not tracking client \"%s\"", id);
+            return NULL;
+        }
+        syslog(LOG_INFO, "Cursor table full, dropping cursor of client \"%s\"", cursor->id);
+    }
+
+    if (strcmp(cursor->id, id) != 0) {
+        strcpy(cursor->id, id);
+        cursor->seq = 0;
+        cursor->offset = 0;
+    }
+    cursor->last_used = time(NULL);
+    cursor->users++;
+    return cursor;
+}
+
+/**
+ * Release a cursor taken with get_cursor().  Caller holds data_lock.
+ */
+static void put_cursor(struct client_cursor *cursor)
+{
+    cursor->users--;
+}
+
+/**
+ * Parse the decimal number of @param len bytes at @param str, which must
+ * not exceed @param max.
+ * Returns 0 and stores it in @param value, or -1 if it is not a number.
+ */
+static int parse_number(const char *str, size_t len, unsigned long long max,
+                        unsigned long long *value)
+{
+    unsigned long long n = 0;
+    if (len == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9' || n > (max - (str[i] - '0')) / 10) {
+            return -1;
+        }
+        n = n * 10 + (str[i] - '0');
+    }
+    *value = n;
+    return 0;
+}
+
+/**
+ * Parse the "<gen>:<seq>" record position of @param len bytes at
+ * @param str into @param generation and @param seq.
+ * Returns 0 on success, -1 if it is not a position.
+ */
+static int parse_position(const char *str, size_t len, unsigned long long *generation,
+                          unsigned long *seq)
+{
+    const char *colon = memchr(str, ':', len);
+    unsigned long long value;
+    if (!colon || parse_number(str, colon - str, ULLONG_MAX, generation) != 0 ||
+        parse_number(colon + 1, len - (colon + 1 - str), ULONG_MAX, &value) != 0) {
+        return -1;
+    }
+    *seq = value;
+    return 0;
+}
+
+/**
+ * Parse a "AESD_ACK:<gen>:<seq>\n" packet of @param len bytes into
+ * @param generation and @param seq.
+ * Returns 0 on success, -1 if the packet is not an acknowledgement.
+ */
+static int parse_ack(const char *packet, size_t len, unsigned long long *generation,
+                     unsigned long *seq)
+{
+    size_t prefix_len = strlen(ACK_CMD);
+    if (len <= prefix_len || strncmp(packet, ACK_CMD, prefix_len) != 0) {
+        return -1;
+    }
+    // Strip '\n'
+    return parse_position(packet + prefix_len, len - prefix_len - 1, generation, seq);
+}
+
+/**
+ * Parse a "AESD_CLIENT:<id>[ <class>][ <gen>:<seq>]\n" handshake packet of
+ * @param len bytes, where <class> is CLASS_BULK or CLASS_INTERACTIVE and
+ * <gen>:<seq> the position of the last record the client received.
+ * On success copies the id into @param id, stores the requested class in
+ * @param priority (left untouched if none was given) and the position in
+ * @param generation and @param ack (the current generation and 0 if none
+ * was given) and returns 0.
+ * Returns -1 if the packet is not a valid handshake.
+ */
+static int parse_client_id(const char *packet, size_t len, char id[CLIENT_ID_MAX],
+                           enum workpool_priority *priority,
+                           unsigned long long *generation, unsigned long *ack)
+{
+    size_t prefix_len = strlen(CLIENT_ID_CMD);
+    if (len <= prefix_len || strncmp(packet, CLIENT_ID_CMD, prefix_len) != 0) {
+        return -1;
+    }
+
+    const char *arg = packet + prefix_len;
+    size_t arg_len = len - prefix_len - 1;   // strip '\n'
+
+    size_t id_len = 0;
+    while (id_len < arg_len && arg[id_len] != ' ') {
+        // Printable, without whitespace: the id is a field of CURSOR_FILE
+        if (!isgraph((unsigned char)arg[id_len])) {
+            return -1;
+        }
+        id_len++;
+    }
+    if (id_len == 0 || id_len >= CLIENT_ID_MAX) {
+        return -1;
+    }
+
+    enum workpool_priority requested = *priority;
+    unsigned long long gen = data_generation;
+    unsigned long seq = 0;
+    size_t pos = id_len;
+    while (pos < arg_len) {
+        // Each option is preceded by a single space
+        const char *opt = arg + ++pos;
+        size_t opt_len = 0;
+        while (pos < arg_len && arg[pos] != ' ') {
+            opt_len++;
+            pos++;
+        }
+        if (opt_len == strlen(CLASS_BULK) && strncmp(opt, CLASS_BULK, opt_len) == 0) {
+            requested = WORKPOOL_PRIO_LOW;
+        } else if (opt_len == strlen(CLASS_INTERACTIVE) &&
+                   strncmp(opt, CLASS_INTERACTIVE, opt_len) == 0) {
+            requested = WORKPOOL_PRIO_HIGH;
+        } else if (parse_position(opt, opt_len, &gen, &seq) != 0) {
+            return -1;
+        }
+    }
+
+    memcpy(id, arg, id_len);
+    id[id_len] = '\0';
+    *priority = requested;
+    *generation = gen;
+    *ack = seq;
+    return 0;
+}
+
+/**
+ * Start a replay of everything not yet sent to the client of @param conn
+ * (the whole file for an anonymous client).
+ */
+static void replay_start(struct replay *replay, const struct connection *conn)
+{
+    pthread_mutex_lock(&data_lock);
+    replay->limit = data_size;
+    pthread_mutex_unlock(&data_lock);
+    replay->offset = conn->cursor ? conn->sent_offset : 0;
+    replay->records = conn->cursor ? conn->sent_seq : 0;
+}
+
+/**
+ * Complete @param replay: an identified client of @param conn is sent only
+ * the records after it from now on.  Its cursor does not move until the
+ * client acknowledges them.
+ */
+static void replay_finish(const struct replay *replay, struct connection *conn)
+{
+    if (conn->cursor) {
+        conn->sent_seq = replay->records;
+        conn->sent_offset = replay->offset;
+    }
+}
+
+/**
+ * Scan DATA_FILE forward from the end of record @param seq, at
+ * @param offset, to the end of record @param target, not reading past
+ * @param limit.  Both are updated to the last record end reached, which is
+ * before @param target if the file has fewer records.
+ * Returns 0 on success, -1 on error.
+ */
+static int find_record_end(unsigned long *seq, off_t *offset, unsigned long target,
+                           off_t limit)
+{
+    int fd = open(DATA_FILE, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "open(\"%s\") for read failed: %s", DATA_FILE, strerror(errno));
+        return -1;
+    }
+
+    char buf[REPLAY_BUF_SIZE];
+    off_t pos = *offset;
+    while (*seq < target && pos < limit) {
+        size_t want = limit - pos < (off_t)sizeof(buf) ? (size_t)(limit - pos) : sizeof(buf);
+        ssize_t bytes = pread(fd, buf, want, pos);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            syslog(LOG_ERR, "read(\"%s\") failed: %s", DATA_FILE, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < bytes && *seq < target; i++) {
+            if (buf[i] == '\n') {
+                (*seq)++;
+                *offset = pos + i + 1;
+            }
+        }
+        pos += bytes;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * The client of @param conn acknowledged having received every record up
+ * to @param seq of data generation @param generation: move its cursor
+ * there and persist it.  Acknowledgements of another generation, or of
+ * records the file does not have, are ignored.
+ */
+static void cursor_ack(struct connection *conn, unsigned long long generation,
+                       unsigned long seq)
+{
+    struct client_cursor *cursor = conn->cursor;
+
+    if (generation != data_generation) {
+        syslog(LOG_INFO, "Ignoring position of data generation %llu from \"%s\"",
+               generation, cursor->id);
+        return;
+    }
+
+    pthread_mutex_lock(&data_lock);
+    unsigned long acked = cursor->seq;
+    off_t offset = cursor->offset;
+    off_t limit = data_size;
+    pthread_mutex_unlock(&data_lock);
+    if (seq <= acked) {
+        return;
+    }
+
+    // Usually the client acknowledges what this connection sent it
+    if (seq == conn->sent_seq) {
+        acked = seq;
+        offset = conn->sent_offset;
+    } else if (find_record_end(&acked, &offset, seq, limit) != 0) {
+        return;
+    } else if (acked < seq) {
+        syslog(LOG_INFO, "Ignoring acknowledgement of record %lu from \"%s\", only %lu stored",
+               seq, cursor->id, acked);
+        return;
+    }
+
+    // Any cursor position is consistent with the file, so only move forward
+    pthread_mutex_lock(&data_lock);
+    if (acked > cursor->seq) {
+        cursor->seq = acked;
+        cursor->offset = offset;
+        cursor->last_used = time(NULL);
+        save_cursors();
+    }
+    pthread_mutex_unlock(&data_lock);
+
+    // Never send again what the client says it has
+    if (acked > conn->sent_seq) {
+        conn->sent_seq = acked;
+        conn->sent_offset = offset;
+    }
+}
+
+/**
+ * Continue @param replay: send at most @param budget more bytes of
+ * DATA_FILE to the client socket.  The replay is complete once
+ * replay->offset reaches replay->limit.
+ * Returns 0 on success, 1 if a non-blocking socket is full (the replay
+ * then stops after the bytes the socket took), -1 on error.
+ */
+static int send_file_contents(int client_fd, struct replay *replay, off_t budget)
+{
+    int fd = open(DATA_FILE, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "open(\"%s\") for read failed: %s", DATA_FILE, strerror(errno));
+        return -1;
+    }
+
+    char buf[REPLAY_BUF_SIZE];
+    ssize_t bytes = 0;
+    off_t end = replay->limit;
+    if (budget < end - replay->offset) {
+        end = replay->offset + budget;
+    }
+
+    while (replay->offset < end &&
+           (bytes = pread(fd, buf, (end - replay->offset < (off_t)sizeof(buf)) ?
+                                   (size_t)(end - replay->offset) : sizeof(buf),
+                          replay->offset)) > 0) {
+        ssize_t sent_total = 0;
+        while (sent_total < bytes) {
+            ssize_t s = send(client_fd, buf + sent_total, bytes - sent_total, MSG_NOSIGNAL);
+            if (s < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                int err = errno;
+                close(fd);
+                if (err == EAGAIN || err == EWOULDBLOCK) {
+                    return 1;
+                }
+                syslog(LOG_ERR, "send() failed: %s", strerror(err));
+                return -1;
+            }
+
+            // Only what the socket took counts as sent
+            for (ssize_t i = sent_total; i < sent_total + s; i++) {
+                if (buf[i] == '\n') {
+                    replay->records++;
+                }
+            }
+            replay->offset += s;
+            sent_total += s;
+        }
+    }
+
+    if (bytes < 0) {
+        syslog(LOG_ERR, "read(\"%s\") failed: %s", DATA_FILE, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (bytes == 0 && replay->offset < end) {
+        // The file ends before data_size said: the replay is complete
+        syslog(LOG_ERR, "\"%s\" ends at %lld, short of %lld", DATA_FILE,
+               (long long)replay->offset, (long long)replay->limit);
+        replay->limit = replay->offset;
+    }
+
+    if (close(fd) == -1) {
+        syslog(LOG_ERR, "close data file failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Send the client of @param conn everything it has not been sent yet.
+ * Anonymous clients always get the entire file; identified clients get the
+ * records after the last one sent to them.
+ * Returns 0 on success, -1 on error.
+ */
+static int send_unseen_records(struct connection *conn)
+{
+    struct replay replay;
+    replay_start(&replay, conn);
+
+    if (send_file_contents(conn->fd, &replay, replay.limit) != 0) {
+        return -1;
+    }
+
+    replay_finish(&replay, conn);
+    return 0;
+}
+
+/**
+ * Block SIGINT, SIGTERM and SIGUSR1 in the calling thread, saving the
+ * previous mask in @param old_mask.  Threads created meanwhile inherit the
+ * blocked mask, so the signals are always delivered to the main thread and
+ * interrupt its poll()/epoll_wait().
+ */
+static void block_server_signals(sigset_t *old_mask)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, old_mask);
+}
+
+/**
+ * Add a freshly accepted connection to the registry.
+ * Returns NULL on allocation failure.
+ */
+static struct connection *connection_new(int client_fd, const struct sockaddr_in *addr,
+                                         enum workpool_priority priority)
+{
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        syslog(LOG_ERR, "calloc() failed for new connection");
+        return NULL;
+    }
+
+    conn->fd = client_fd;
+    conn->first_packet = 1;
+    conn->priority = priority;
+    if (!inet_ntop(AF_INET, &addr->sin_addr, conn->ip, sizeof(conn->ip))) {
+        // Fallback if inet_ntop fails
+        strncpy(conn->ip, "unknown", sizeof(conn->ip) - 1);
+    }
+
+    pthread_mutex_lock(&conn_lock);
+    conn->next = connections;
+    if (connections) {
+        connections->prev = conn;
+    }
+    connections = conn;
+    pthread_mutex_unlock(&conn_lock);
+
+    atomic_fetch_add_explicit(&stat_connections, 1, memory_order_relaxed);
+    syslog(LOG_INFO, "Accepted connection from %s", conn->ip);
+    return conn;
+}
+
+/**
+ * Close the socket of @param conn, drop it from the registry and free it.
+ */
+static void connection_close(struct connection *conn)
+{
+    ALLOC_SCOPE_LEAVE();
+    syslog(LOG_INFO, "Closed connection from %s", conn->ip);
+#ifdef AESD_ALLOC_STATS
+    syslog(LOG_INFO, "Allocations for %s: %lu allocs, %lu reallocs, %lu frees, "
+           "%llu bytes, %lld bytes heap peak; %lu of %lu packets allocated", conn->ip,
+           conn->allocs.allocs, conn->allocs.reallocs, conn->allocs.frees,
+           conn->allocs.bytes, conn->allocs.heap_peak, conn->packets_allocating,
+           conn->packets);
+    long long peak = atomic_load_explicit(&stat_conn_heap_peak_max, memory_order_relaxed);
+    while (conn->allocs.heap_peak > peak &&
+           !atomic_compare_exchange_weak_explicit(&stat_conn_heap_peak_max, &peak,
+                                                  conn->allocs.heap_peak,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+#endif
+
+    if (close(conn->fd) == -1) {
+        syslog(LOG_ERR, "close(client_fd) failed: %s", strerror(errno));
+    }
+
+    if (conn->cursor) {
+        pthread_mutex_lock(&data_lock);
+        put_cursor(conn->cursor);
+        pthread_mutex_unlock(&data_lock);
+    }
+
+    pthread_mutex_lock(&conn_lock);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    if (!connections) {
+        pthread_cond_broadcast(&conn_cond);
+    }
+    pthread_mutex_unlock(&conn_lock);
+
+    free(conn->packet_buf);
+    free(conn);
+}
+
+/**
+ * Make room for at least RECV_MIN more bytes at the end of the packet
+ * buffer of @param conn.  The buffer grows geometrically and is never
+ * shrunk, so once it fits the longest packet of the connection receiving
+ * does not allocate any more.
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int connection_reserve(struct connection *conn)
+{
+    if (conn->packet_cap - conn->packet_size >= RECV_MIN) {
+        return 0;
+    }
+
+    size_t cap = conn->packet_cap ? conn->packet_cap : PACKET_BUF_INITIAL;
+    while (cap - conn->packet_size < RECV_MIN) {
+        cap *= 2;
+    }
+    char *new_buf = realloc(conn->packet_buf, cap);
+    if (!new_buf) {
+        syslog(LOG_ERR, "realloc() failed while growing packet buffer");
+        return -1;
+    }
+    conn->packet_buf = new_buf;
+    conn->packet_cap = cap;
+    return 0;
+}
+
+/**
+ * Receive into the free space at the end of the packet buffer of
+ * @param conn, with recv() @param flags.
+ * Returns what recv() returned, or -1 with errno ENOMEM if the buffer
+ * could not be grown.
+ */
+static ssize_t connection_recv(struct connection *conn, int flags)
+{
+    if (connection_reserve(conn) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t bytes = recv(conn->fd, conn->packet_buf + conn->packet_size,
+                         conn->packet_cap - conn->packet_size, flags);
+    if (bytes > 0) {
+        conn->packet_size += bytes;
+    }
+    return bytes;
+}
+
+/**
+ * Take the next complete (newline terminated) packet out of the buffer of
+ * @param conn.  The returned pointer is valid until the next call.
+ * Returns 1 if a packet was found, 0 if only a partial packet (if any) is
+ * left, which is then moved to the front of the buffer.
+ */
+static int connection_next_packet(struct connection *conn, const char **packet, size_t *len)
+{
+    size_t start = conn->packet_start;
+    char *nl = NULL;
+    if (start < conn->packet_size) {
+        nl = memchr(conn->packet_buf + start, '\n', conn->packet_size - start);
+    }
+    if (nl) {
+        *packet = conn->packet_buf + start;
+        *len = nl - *packet + 1;   // include '\n'
+        conn->packet_start += *len;
+        return 1;
+    }
+
+    // Remove processed data from packet_buf (keep leftover partial packet, if any)
+    if (start > 0) {
+        size_t remaining = conn->packet_size - start;
+        memmove(conn->packet_buf, conn->packet_buf + start, remaining);
+        conn->packet_size = remaining;
+        conn->packet_start = 0;
+    }
+    return 0;
+}
+
+/**
+ * Mark the start of a packet of @param conn for the allocation counters.
+ */
+static void packet_begin(struct connection *conn)
+{
+#ifdef AESD_ALLOC_STATS
+    conn->packet_mark = conn->allocs.allocs + conn->allocs.reallocs;
+#else
+    (void)conn;
+#endif
+}
 
 /**
- * Signal handler: just set a flag.
+ * Count a packet of @param conn as answered, along with the allocations
+ * made since packet_begin().
  */
-static void signal_handler(int signo)
+static void packet_done(struct connection *conn)
 {
-    if (signo == SIGINT || signo == SIGTERM) {
-        exit_requested = 1;
+    atomic_fetch_add_explicit(&stat_packets, 1, memory_order_relaxed);
+#ifdef AESD_ALLOC_STATS
+    unsigned long allocs = conn->allocs.allocs + conn->allocs.reallocs - conn->packet_mark;
+    conn->packets++;
+    if (allocs == 0) {
+        return;
     }
+    conn->packets_allocating++;
+    atomic_fetch_add_explicit(&stat_packets_allocating, 1, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&stat_packet_allocs_max, memory_order_relaxed);
+    while (allocs > max &&
+           !atomic_compare_exchange_weak_explicit(&stat_packet_allocs_max, &max, allocs,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+#else
+    (void)conn;
+#endif
 }
 
 /**
- * Append a buffer to DATA_FILE, creating it if necessary.
+ * Send the @param len bytes of @param line to @param client_fd.
  * Returns 0 on success, -1 on error.
  */
-static int append_to_file(const char *data, size_t len)
+static int send_line(int client_fd, const char *line, size_t len)
 {
-    int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (fd == -1) {
-        syslog(LOG_ERR, "open(\"%s\") failed: %s", DATA_FILE, strerror(errno));
-        return -1;
-    }
-
-    ssize_t written = 0;
-    while (written < (ssize_t)len) {
-        ssize_t w = write(fd, data + written, len - written);
-        if (w < 0) {
+    for (size_t sent = 0; sent < len; ) {
+        ssize_t s = send(client_fd, line + sent, len - sent, MSG_NOSIGNAL);
+        if (s < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            syslog(LOG_ERR, "write(\"%s\") failed: %s", DATA_FILE, strerror(errno));
-            close(fd);
+            syslog(LOG_ERR, "send() failed: %s", strerror(errno));
             return -1;
         }
-        written += w;
-    }
-
-    if (close(fd) == -1) {
-        syslog(LOG_ERR, "close data file failed: %s", strerror(errno));
-        return -1;
+        sent += s;
     }
-
     return 0;
 }
 
 /**
- * Send entire contents of DATA_FILE to the client socket.
+ * Answer STATS_CMD: send one line of "key=value" server statistics.
  * Returns 0 on success, -1 on error.
  */
-static int send_file_contents(int client_fd)
+static int send_stats(int client_fd)
 {
-    int fd = open(DATA_FILE, O_RDONLY);
-    if (fd == -1) {
-        syslog(LOG_ERR, "open(\"%s\") for read failed: %s", DATA_FILE, strerror(errno));
-        return -1;
-    }
+    char line[512];
+    int len = snprintf(line, sizeof(line), "AESD_STATS connections=%lu packets=%lu",
+                       atomic_load(&stat_connections), atomic_load(&stat_packets));
+#ifdef AESD_ALLOC_STATS
+    struct alloc_stats total;
+    size_t live, peak;
+    alloc_stats_global(&total, &live, &peak);
+    len += snprintf(line + len, sizeof(line) - len,
+                    " allocs=%lu reallocs=%lu frees=%lu bytes=%llu heap_live=%zu"
+                    " heap_peak=%zu packets_allocating=%lu packet_allocs_max=%lu"
+                    " conn_heap_peak_max=%lld",
+                    total.allocs, total.reallocs, total.frees, total.bytes, live, peak,
+                    atomic_load(&stat_packets_allocating),
+                    atomic_load(&stat_packet_allocs_max),
+                    atomic_load(&stat_conn_heap_peak_max));
+#endif
+    len += snprintf(line + len, sizeof(line) - len, "\n");
 
-    char buf[1024];
-    ssize_t bytes;
+    return send_line(client_fd, line, len);
+}
 
-    while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
-        ssize_t sent_total = 0;
-        while (sent_total < bytes) {
-            ssize_t s = send(client_fd, buf + sent_total, bytes - sent_total, 0);
-            if (s < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
-                syslog(LOG_ERR, "send() failed: %s", strerror(errno));
-                close(fd);
-                return -1;
-            }
-            sent_total += s;
-        }
-    }
+/**
+ * Answer the CLIENT_ID_CMD handshake of @param conn with the data
+ * generation and the record its replay starts after.
+ * Returns 0 on success, -1 on error.
+ */
+static int send_cursor(const struct connection *conn)
+{
+    char line[64];
+    int len = snprintf(line, sizeof(line), CURSOR_REPLY "%llu:%lu\n", data_generation,
+                       conn->sent_seq);
+    return send_line(conn->fd, line, len);
+}
 
-    if (bytes < 0) {
-        syslog(LOG_ERR, "read(\"%s\") failed: %s", DATA_FILE, strerror(errno));
-        close(fd);
-        return -1;
-    }
+/**
+ * Store one complete packet: either the CLIENT_ID_CMD handshake or
+ * STATS_CMD (both only accepted as first packet, never stored), ACK_CMD
+ * from an identified client (never stored or answered) or a record
+ * appended to DATA_FILE.
+ * Returns 0 if the packet is to be answered with a replay, 1 if it has
+ * already been answered, -1 if the record could not be stored.
+ */
+static int process_packet(struct connection *conn, const char *packet, size_t len)
+{
+    char client_id[CLIENT_ID_MAX];
+    unsigned long long generation;
+    unsigned long seq;
+    int rc = 0;
 
-    if (close(fd) == -1) {
-        syslog(LOG_ERR, "close data file failed: %s", strerror(errno));
-        return -1;
+    packet_begin(conn);
+    if (conn->first_packet && len == strlen(STATS_CMD) &&
+        memcmp(packet, STATS_CMD, len) == 0) {
+        // Errors logged in send_stats()
+        send_stats(conn->fd);
+        rc = 1;
+    } else if (conn->first_packet &&
+               parse_client_id(packet, len, client_id, &conn->priority, &generation,
+                               &seq) == 0) {
+        // Handshake: not stored, replay what the client missed
+        syslog(LOG_INFO, "Client identified as \"%s\" (%s)", client_id,
+               conn->priority == WORKPOOL_PRIO_LOW ? CLASS_BULK : CLASS_INTERACTIVE);
+        pthread_mutex_lock(&data_lock);
+        conn->cursor = get_cursor(client_id);
+        if (conn->cursor) {
+            conn->sent_seq = conn->cursor->seq;
+            conn->sent_offset = conn->cursor->offset;
+        }
+        pthread_mutex_unlock(&data_lock);
+        if (conn->cursor) {
+            cursor_ack(conn, generation, seq);
+            // Errors logged in send_line(), the replay fails the same way
+            send_cursor(conn);
+        }
+    } else if (conn->cursor && parse_ack(packet, len, &generation, &seq) == 0) {
+        cursor_ack(conn, generation, seq);
+        rc = 1;
+    } else {
+        pthread_mutex_lock(&data_lock);
+        rc = append_to_file(packet, len);   // errors logged in append_to_file()
+        pthread_mutex_unlock(&data_lock);
     }
+    conn->first_packet = 0;
 
-    return 0;
+    return rc;
 }
 
 /**
- * Handle a single client connection:
+ * Thread-per-connection mode (-t): handle a single client connection:
  *  - Receive data until EOF, connection close, error, or exit_requested
  *  - Each time a newline-terminated packet is assembled:
  *      * append to file
- *      * send entire file back to client
+ *      * send entire file back to client (or, for a client that identified
+ *        itself with CLIENT_ID_CMD, only the records it has not seen yet)
  */
-static void handle_client(int client_fd)
+static void *connection_thread(void *arg)
 {
-    char recv_buf[1024];
-
-    char *packet_buf = NULL;     // dynamic buffer for partial/complete packets
-    size_t packet_size = 0;      // bytes currently stored in packet_buf
+    struct connection *conn = arg;
 
+    ALLOC_SCOPE_ENTER(conn);
     while (!exit_requested) {
-        ssize_t bytes = recv(client_fd, recv_buf, sizeof(recv_buf), 0);
+        ssize_t bytes = connection_recv(conn, 0);
         if (bytes < 0) {
-            if (errno == EINTR && exit_requested) {
-                // Interrupted by signal and exit requested
-                break;
-            }
             if (errno == EINTR) {
-                // Interrupted by signal but not necessarily exit, continue
+                // Interrupted by signal, loop condition checks exit_requested
                 continue;
             }
             syslog(LOG_ERR, "recv() failed: %s", strerror(errno));
@@ -151,75 +1145,369 @@ static void handle_client(int client_fd)
             break;
         }
 
-        // Grow packet buffer
-        char *new_buf = realloc(packet_buf, packet_size + bytes);
-        if (!new_buf) {
-            syslog(LOG_ERR, "realloc() failed while growing packet buffer");
-            free(packet_buf);
-            packet_buf = NULL;
-            packet_size = 0;
+        // Process all complete packets (up to newline)
+        const char *packet;
+        size_t len;
+        while (connection_next_packet(conn, &packet, &len)) {
+            if (process_packet(conn, packet, len) != 0) {
+                continue;
+            }
+            // Errors logged in send_file_contents()
+            if (send_unseen_records(conn) == 0) {
+                packet_done(conn);
+            }
+        }
+    }
+
+    connection_close(conn);
+    return NULL;
+}
+
+static void connection_replay_task(struct workpool_task *task);
+
+/**
+ * Pool mode: continue with the next buffered packet of @param conn.
+ * Stores the packet and queues the replay task for it; once no complete
+ * packet is left the connection is re-armed in the epoll set, or closed
+ * if the peer went away.  @param conn must not be touched after this.
+ */
+static void connection_advance(struct connection *conn)
+{
+    const char *packet;
+    size_t len;
+
+    while (!exit_requested && connection_next_packet(conn, &packet, &len)) {
+        if (process_packet(conn, packet, len) != 0) {
+            continue;
+        }
+        conn->task.fn = connection_replay_task;
+        conn->task.priority = conn->priority;
+        ALLOC_SCOPE_LEAVE();
+        if (workpool_submit(pool, &conn->task) == 0) {
+            return;
+        }
+        syslog(LOG_ERR, "Failed to queue replay for %s", conn->ip);
+        conn->eof = 1;
+        break;
+    }
+
+    if (exit_requested || conn->eof) {
+        connection_close(conn);
+        return;
+    }
+
+    ALLOC_SCOPE_LEAVE();
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl(MOD) failed: %s", strerror(errno));
+        connection_close(conn);
+    }
+}
+
+/**
+ * Pool task: drain what the socket has to offer without blocking, then
+ * go on with the packets received.
+ */
+static void connection_read_task(struct workpool_task *task)
+{
+    struct connection *conn =
+        (struct connection *)((char *)task - offsetof(struct connection, task));
+
+    ALLOC_SCOPE_ENTER(conn);
+    for (int i = 0; i < MAX_READS_PER_TASK; i++) {
+        ssize_t bytes = connection_recv(conn, MSG_DONTWAIT);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                syslog(LOG_ERR, "recv() failed: %s", strerror(errno));
+                conn->eof = 1;
+            }
+            break;
+        } else if (bytes == 0) {
+            // Client closed the connection
+            conn->eof = 1;
             break;
         }
-        packet_buf = new_buf;
-        memcpy(packet_buf + packet_size, recv_buf, bytes);
-        packet_size += bytes;
+    }
 
-        // Process all complete packets (up to newline)
-        size_t start = 0;
-        for (size_t i = 0; i < packet_size; i++) {
-            if (packet_buf[i] == '\n') {
-                size_t packet_len = i - start + 1; // include '\n'
-
-                if (append_to_file(packet_buf + start, packet_len) != 0) {
-                    // Error logged in append_to_file()
-                    start = i + 1;
-                    break;
-                }
+    connection_advance(conn);
+}
+
+/**
+ * Pool task: answer the packet stored by connection_advance().
+ * Sends at most REPLAY_CHUNK bytes per run; the rest of a large replay is
+ * queued again at low priority so it yields to interactive work.  When the
+ * client does not keep up, the connection waits in the epoll set for
+ * EPOLLOUT instead of holding the worker.
+ */
+static void connection_replay_task(struct workpool_task *task)
+{
+    struct connection *conn =
+        (struct connection *)((char *)task - offsetof(struct connection, task));
+
+    ALLOC_SCOPE_ENTER(conn);
+    if (!conn->replaying) {
+        replay_start(&conn->replay, conn);
+        conn->replaying = 1;
+    }
+
+    // Errors logged in send_file_contents()
+    int rc = exit_requested ? -1 : send_file_contents(conn->fd, &conn->replay, REPLAY_CHUNK);
+    if (rc == 1) {
+        // The event loop queues this task again once the socket drains
+        conn->task.priority = WORKPOOL_PRIO_LOW;
+        ALLOC_SCOPE_LEAVE();
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = conn };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+            return;
+        }
+        syslog(LOG_ERR, "epoll_ctl(MOD) failed: %s", strerror(errno));
+        conn->eof = 1;
+    } else if (rc == 0) {
+        if (conn->replay.offset < conn->replay.limit) {
+            conn->task.priority = WORKPOOL_PRIO_LOW;
+            ALLOC_SCOPE_LEAVE();
+            if (workpool_submit(pool, &conn->task) == 0) {
+                return;
+            }
+            syslog(LOG_ERR, "Failed to queue replay for %s", conn->ip);
+            conn->eof = 1;
+        } else {
+            replay_finish(&conn->replay, conn);
+            packet_done(conn);
+        }
+    } else {
+        conn->eof = 1;
+    }
+
+    conn->replaying = 0;
+    connection_advance(conn);
+}
+
+/**
+ * Accept one pending connection on @param listener and hand it to either
+ * a new thread (@param thread_mode) or the epoll set.
+ * Returns -1 if accept() was interrupted, 0 otherwise.
+ */
+static int accept_client(struct listener *listener, int thread_mode)
+{
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    // Pool workers must never block on a client socket
+    int client_fd = accept4(listener->fd, (struct sockaddr *)&client_addr, &client_len,
+                            thread_mode ? 0 : SOCK_NONBLOCK);
+    if (client_fd == -1) {
+        if (errno == EINTR) {
+            return -1;
+        }
+        syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
+        return 0;
+    }
+
+    struct connection *conn = connection_new(client_fd, &client_addr, listener->priority);
+    if (!conn) {
+        close(client_fd);
+        return 0;
+    }
+
+    if (thread_mode) {
+        pthread_t thread;
+        sigset_t old_mask;
+        block_server_signals(&old_mask);
+        int rc = pthread_create(&thread, NULL, connection_thread, conn);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        if (rc != 0) {
+            syslog(LOG_ERR, "pthread_create() failed: %s", strerror(rc));
+            connection_close(conn);
+            return 0;
+        }
+        pthread_detach(thread);
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl(ADD) failed: %s", strerror(errno));
+        connection_close(conn);
+    }
+    return 0;
+}
+
+/**
+ * Pool mode main loop: accept connections and queue a read task for every
+ * connection that becomes readable, or its replay task if it was waiting
+ * to become writable, until exit_requested.
+ */
+static void run_event_loop(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!exit_requested) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        check_profile_request();
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
 
-                if (send_file_contents(client_fd) != 0) {
-                    // Error logged in send_file_contents()
-                    start = i + 1;
-                    break;
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            int is_listener = 0;
+            for (int l = 0; l < listener_count; l++) {
+                if (ptr == &listeners[l]) {
+                    accept_client(&listeners[l], 0);
+                    is_listener = 1;
                 }
+            }
+            if (is_listener) {
+                continue;
+            }
 
-                start = i + 1;
+            // Priority of a replay was set when it started waiting
+            struct connection *conn = ptr;
+            if (conn->replaying) {
+                conn->task.fn = connection_replay_task;
+            } else {
+                conn->task.fn = connection_read_task;
+                conn->task.priority = conn->priority;
+            }
+            if (workpool_submit(pool, &conn->task) != 0) {
+                syslog(LOG_ERR, "Failed to queue task for %s", conn->ip);
+                connection_close(conn);
             }
         }
+    }
+}
 
-        // Remove processed data from packet_buf (keep leftover partial packet, if any)
-        if (start > 0 && start <= packet_size) {
-            size_t remaining = packet_size - start;
-            memmove(packet_buf, packet_buf + start, remaining);
-            packet_size = remaining;
+/**
+ * Thread-per-connection main loop: accept until exit_requested.
+ */
+static void run_accept_loop(void)
+{
+    struct pollfd fds[MAX_LISTENERS];
+    for (int l = 0; l < listener_count; l++) {
+        fds[l].fd = listeners[l].fd;
+        fds[l].events = POLLIN;
+    }
 
-            char *shrink_buf = realloc(packet_buf, packet_size);
-            if (shrink_buf || packet_size == 0) {
-                packet_buf = shrink_buf;
+    while (!exit_requested) {
+        int n = poll(fds, listener_count, -1);
+        check_profile_request();
+        if (n == -1) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "poll() failed: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (int l = 0; l < listener_count; l++) {
+            if (fds[l].revents & POLLIN) {
+                accept_client(&listeners[l], 1);
             }
         }
     }
+}
+
+/**
+ * Create a socket listening on all interfaces at @param port and add it to
+ * listeners[] with class @param priority.
+ * Returns 0 on success, -1 on error.
+ */
+static int add_listener(int port, enum workpool_priority priority)
+{
+    // Create socket
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Allow reuse of address
+    int optval = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+        syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+        syslog(LOG_ERR, "bind() to port %d failed: %s", port, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    // Listen
+    if (listen(server_fd, BACKLOG) == -1) {
+        syslog(LOG_ERR, "listen() failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
 
-    free(packet_buf);
+    listeners[listener_count].fd = server_fd;
+    listeners[listener_count].priority = priority;
+    listener_count++;
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    int server_fd = -1;
     int ret = 0;
     int daemon_mode = 0;
+    int thread_mode = 0;
+    int owns_files = 1;     // the daemon parent leaves DATA_FILE to the child
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    long bulk_port = 0;
 
-    // Parse arguments: allow optional "-d"
-    if (argc == 2) {
-        if (strcmp(argv[1], "-d") == 0) {
+    // Parse arguments: optional "-d", "-t", "-w <workers>", "-b <port>"
+    // and "-P <seconds>"
+    int opt;
+    int usage_error = 0;
+    while ((opt = getopt(argc, argv, "dtw:b:P:")) != -1) {
+        switch (opt) {
+        case 'd':
             daemon_mode = 1;
-        } else {
-            fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
-            return -1;
+            break;
+        case 't':
+            thread_mode = 1;
+            break;
+        case 'w':
+            nworkers = strtol(optarg, NULL, 10);
+            usage_error |= nworkers <= 0;
+            break;
+        case 'b':
+            bulk_port = strtol(optarg, NULL, 10);
+            usage_error |= bulk_port <= 0 || bulk_port >= 65536 || bulk_port == PORT;
+            break;
+        case 'P': {
+            long seconds = strtol(optarg, NULL, 10);
+            usage_error |= seconds <= 0 || seconds > 3600;
+            profile_seconds = (unsigned int)seconds;
+            break;
+        }
+        default:
+            usage_error = 1;
+            break;
         }
-    } else if (argc > 2) {
-        fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
+    }
+    if (usage_error || optind != argc) {
+        fprintf(stderr, "Usage: %s [-d] [-t] [-w workers] [-b bulk_port] [-P seconds]\n",
+                argv[0]);
         return -1;
     }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
 
     // Open syslog
     openlog("aesdsocket", LOG_PID, LOG_USER);
@@ -240,39 +1528,22 @@ int main(int argc, char *argv[])
         ret = -1;
         goto cleanup;
     }
-
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
-        ret = -1;
-        goto cleanup;
-    }
-
-    // Allow reuse of address
-    int optval = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-        syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        syslog(LOG_ERR, "sigaction(SIGUSR1) failed: %s", strerror(errno));
         ret = -1;
         goto cleanup;
     }
 
-    // Bind to port 9000
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(PORT);
-
-    if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
-        syslog(LOG_ERR, "bind() failed: %s", strerror(errno));
-        ret = -1;
-        goto cleanup;
+    // Pick up data and replay cursors left behind by a previous run
+    struct stat st;
+    if (stat(DATA_FILE, &st) == 0) {
+        data_size = st.st_size;
     }
+    load_cursors();
 
-    // Listen
-    if (listen(server_fd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "listen() failed: %s", strerror(errno));
+    // Bind to port 9000, and the bulk class port if requested
+    if (add_listener(PORT, WORKPOOL_PRIO_HIGH) != 0 ||
+        (bulk_port && add_listener((int)bulk_port, WORKPOOL_PRIO_LOW) != 0)) {
         ret = -1;
         goto cleanup;
     }
@@ -287,6 +1558,7 @@ int main(int argc, char *argv[])
         }
         if (pid > 0) {
             // Parent exits, child continues as daemon
+            owns_files = 0;
             ret = 0;
             goto cleanup;
         }
@@ -311,55 +1583,83 @@ int main(int argc, char *argv[])
         // From here on, use syslog only for output
     }
 
-    // Main accept loop
-    while (!exit_requested) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd == -1) {
-            if (errno == EINTR && exit_requested) {
-                // Interrupted by signal, exit requested
-                break;
-            }
-            if (errno == EINTR) {
-                // Interrupted by signal but not exit yet, continue
-                continue;
-            }
+    // Threads are started only now, a fork() above would not carry them over
+    if (thread_mode) {
+        run_accept_loop();
+    } else {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            syslog(LOG_ERR, "epoll_create1() failed: %s", strerror(errno));
+            ret = -1;
+            goto cleanup;
+        }
 
-            syslog(LOG_ERR, "accept() failed: %s", strerror(errno));
-            continue;
+        for (int l = 0; l < listener_count; l++) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listeners[l] };
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[l].fd, &ev) == -1) {
+                syslog(LOG_ERR, "epoll_ctl(ADD) failed: %s", strerror(errno));
+                ret = -1;
+                goto cleanup;
+            }
         }
 
-        char client_ip[INET_ADDRSTRLEN] = {0};
-        if (!inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip))) {
-            // Fallback if inet_ntop fails
-            strncpy(client_ip, "unknown", sizeof(client_ip) - 1);
+        sigset_t old_mask;
+        block_server_signals(&old_mask);
+        pool = workpool_create((unsigned int)nworkers);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        if (!pool) {
+            syslog(LOG_ERR, "workpool_create() failed");
+            ret = -1;
+            goto cleanup;
         }
 
-        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+        run_event_loop();
+    }
+
+    if (exit_requested) {
+        syslog(LOG_INFO, "Caught signal, exiting");
+    }
 
-        handle_client(client_fd);
+cleanup:
+    // Wake up connection threads blocked on their sockets
+    pthread_mutex_lock(&conn_lock);
+    for (struct connection *conn = connections; conn; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn_lock);
 
-        syslog(LOG_INFO, "Closed connection from %s", client_ip);
+    // Queued tasks see exit_requested and close their connections
+    workpool_destroy(pool);
 
-        if (close(client_fd) == -1) {
-            syslog(LOG_ERR, "close(client_fd) failed: %s", strerror(errno));
+    // Wait for the connection threads; in pool mode close the connections
+    // still idle in epoll
+    pthread_mutex_lock(&conn_lock);
+    if (!thread_mode) {
+        while (connections) {
+            struct connection *conn = connections;
+            pthread_mutex_unlock(&conn_lock);
+            connection_close(conn);
+            pthread_mutex_lock(&conn_lock);
         }
     }
+    while (connections) {
+        pthread_cond_wait(&conn_cond, &conn_lock);
+    }
+    pthread_mutex_unlock(&conn_lock);
 
-    if (exit_requested) {
-        syslog(LOG_INFO, "Caught signal, exiting");
+    if (epoll_fd != -1) {
+        close(epoll_fd);
     }
 
-cleanup:
-    if (server_fd != -1) {
-        if (close(server_fd) == -1) {
+    for (int l = 0; l < listener_count; l++) {
+        if (close(listeners[l].fd) == -1) {
             syslog(LOG_ERR, "close(server_fd) failed: %s", strerror(errno));
         }
     }
 
-    // Remove data file on exit; ignore error if it doesn't exist
-    if (remove(DATA_FILE) == -1 && errno != ENOENT) {
+    // Remove data file on exit; ignore error if it doesn't exist.  The
+    // replay cursors are kept for the next run.
+    if (owns_files && remove(DATA_FILE) == -1 && errno != ENOENT) {
         syslog(LOG_ERR, "remove(\"%s\") failed: %s", DATA_FILE, strerror(errno));
     }
 
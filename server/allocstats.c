@@ -0,0 +1,200 @@
+/**
+ * allocstats.c
+ *
+ * malloc family interposition for the AESD_ALLOC_STATS build, see
+ * allocstats.h.  Nothing here is compiled in a normal build.
+ */
+
+#include "allocstats.h"
+
+#ifdef AESD_ALLOC_STATS
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
+
+// glibc's own implementations, always exported next to the public names
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+__thread struct alloc_stats *alloc_stats_scope = NULL;
+
+static atomic_ulong total_allocs;
+static atomic_ulong total_reallocs;
+static atomic_ulong total_frees;
+static atomic_ullong total_bytes;
+static atomic_size_t heap_live;
+static atomic_size_t heap_peak;
+
+static void heap_grow(size_t size)
+{
+    size_t live = atomic_fetch_add_explicit(&heap_live, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&heap_peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&heap_peak, &peak, live,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+static void heap_shrink(size_t size)
+{
+    atomic_fetch_sub_explicit(&heap_live, size, memory_order_relaxed);
+}
+
+/**
+ * Account @param grow bytes coming into use and @param shrink bytes
+ * released in @param scope, which belongs to the calling thread.
+ */
+static void scope_heap(struct alloc_stats *scope, size_t grow, size_t shrink)
+{
+    scope->heap_live += (long long)grow - (long long)shrink;
+    if (scope->heap_live > scope->heap_peak) {
+        scope->heap_peak = scope->heap_live;
+    }
+}
+
+static void *count_alloc(void *ptr, size_t size)
+{
+    if (!ptr) {
+        return NULL;
+    }
+
+    size_t usable = malloc_usable_size(ptr);
+    atomic_fetch_add_explicit(&total_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_bytes, size, memory_order_relaxed);
+    heap_grow(usable);
+
+    struct alloc_stats *scope = alloc_stats_scope;
+    if (scope) {
+        scope->allocs++;
+        scope->bytes += size;
+        scope_heap(scope, usable, 0);
+    }
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    return count_alloc(__libc_malloc(size), size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    return count_alloc(__libc_calloc(nmemb, size), nmemb * size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return count_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return count_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *valloc(size_t size)
+{
+    return count_alloc(__libc_valloc(size), size);
+}
+
+void *pvalloc(size_t size)
+{
+    return count_alloc(__libc_pvalloc(size), size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = count_alloc(__libc_memalign(alignment, size), size);
+    if (!ptr && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr) {
+        return malloc(size);
+    }
+
+    size_t old_usable = malloc_usable_size(ptr);
+    void *new_ptr = __libc_realloc(ptr, size);
+    if (!new_ptr) {
+        if (size == 0) {
+            // realloc(ptr, 0) freed ptr
+            heap_shrink(old_usable);
+            atomic_fetch_add_explicit(&total_frees, 1, memory_order_relaxed);
+            if (alloc_stats_scope) {
+                alloc_stats_scope->frees++;
+                scope_heap(alloc_stats_scope, 0, old_usable);
+            }
+        }
+        return NULL;
+    }
+
+    size_t new_usable = malloc_usable_size(new_ptr);
+    heap_shrink(old_usable);
+    heap_grow(new_usable);
+    atomic_fetch_add_explicit(&total_reallocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_bytes, size, memory_order_relaxed);
+
+    struct alloc_stats *scope = alloc_stats_scope;
+    if (scope) {
+        scope->reallocs++;
+        scope->bytes += size;
+        scope_heap(scope, new_usable, old_usable);
+    }
+    return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+void free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    size_t usable = malloc_usable_size(ptr);
+    heap_shrink(usable);
+    atomic_fetch_add_explicit(&total_frees, 1, memory_order_relaxed);
+
+    struct alloc_stats *scope = alloc_stats_scope;
+    if (scope) {
+        scope->frees++;
+        scope_heap(scope, 0, usable);
+    }
+    __libc_free(ptr);
+}
+
+void alloc_stats_global(struct alloc_stats *total, size_t *live, size_t *peak)
+{
+    total->allocs = atomic_load(&total_allocs);
+    total->reallocs = atomic_load(&total_reallocs);
+    total->frees = atomic_load(&total_frees);
+    total->bytes = atomic_load(&total_bytes);
+    *live = atomic_load(&heap_live);
+    *peak = atomic_load(&heap_peak);
+}
+
+#endif /* AESD_ALLOC_STATS */
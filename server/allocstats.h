@@ -0,0 +1,49 @@
+/**
+ * allocstats.h
+ *
+ * Allocation counters for aesdsocket, compiled in with "make ALLOC_STATS=1"
+ * (-DAESD_ALLOC_STATS).  The build then interposes malloc, calloc, realloc,
+ * reallocarray, free and the aligned and page-aligned variants of the C
+ * library, so allocations made inside libc on our behalf (fopen(),
+ * syslog(), ...) are counted as well.  Relies on the __libc_* entry points
+ * of glibc.
+ *
+ * Every allocation is counted globally and, if the calling thread has set
+ * alloc_stats_scope, in that scope too (aesdsocket points it at the
+ * connection being serviced).  A scope also tracks the heap it holds:
+ * bytes allocated while it is set minus bytes freed while it is set, and
+ * the peak of that.
+ */
+
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+#ifdef AESD_ALLOC_STATS
+
+#include <stddef.h>
+
+struct alloc_stats {
+    unsigned long allocs;           // malloc, calloc and aligned variants
+    unsigned long reallocs;
+    unsigned long frees;
+    unsigned long long bytes;       // requested by allocs and reallocs
+    long long heap_live;            // usable bytes allocated minus freed
+    long long heap_peak;            // largest heap_live seen
+};
+
+/**
+ * Scope charged for allocations of the calling thread, NULL for none.
+ * Must be reset before the memory holding the scope is freed.
+ */
+extern __thread struct alloc_stats *alloc_stats_scope;
+
+/**
+ * Snapshot the process-wide counters into @param total, and the bytes of
+ * heap currently in use and at most ever in use into @param live and
+ * @param peak.
+ */
+void alloc_stats_global(struct alloc_stats *total, size_t *live, size_t *peak);
+
+#endif /* AESD_ALLOC_STATS */
+
+#endif /* ALLOCSTATS_H */
@@ -0,0 +1,473 @@
+/**
+ * selfprof.c
+ *
+ * Self-profiling with perf_event_open, see selfprof.h.
+ *
+ * Every thread gets its own task-clock sampling event with a user space
+ * callchain and a small mmap ring buffer.  The profiler thread drains the
+ * rings a few times per second, counts identical stacks in a hash table
+ * and writes them out once the requested time has passed.  User space
+ * callchains are unwound by the kernel through frame pointers, so the
+ * server is built with -fno-omit-frame-pointer.
+ */
+
+#define _GNU_SOURCE
+#include "selfprof.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define SAMPLE_FREQ 99              // Hz, off the beat of periodic timers
+#define DRAIN_INTERVAL_MS 100
+#define RING_DATA_PAGES 16          // per thread, must be a power of two
+#define MAX_THREADS 256
+#define MAX_DEPTH 64
+#define STACK_SLOTS 8192            // hash table size, power of two
+
+struct sampled_thread {
+    pid_t tid;
+    int fd;
+    struct perf_event_mmap_page *meta;
+    size_t map_len;
+    char comm[16];
+};
+
+struct stack {
+    unsigned long count;            // 0: slot unused
+    uint64_t hash;
+    unsigned int thread;            // index into profile.threads
+    unsigned int depth;
+    uint64_t ips[MAX_DEPTH];        // leaf first
+};
+
+struct profile {
+    unsigned int seconds;
+    char *output_path;
+    struct sampled_thread threads[MAX_THREADS];
+    unsigned int nthreads;
+    struct stack *stacks;           // STACK_SLOTS entries
+    unsigned int nstacks;
+    unsigned long samples;
+    unsigned long dropped;          // samples lost to a full table or ring
+};
+
+static atomic_int profiling = 0;
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                            int group_fd, unsigned long flags)
+{
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/**
+ * Open and map a sampling event for thread @param tid.  Time spent in the
+ * kernel on behalf of the thread is sampled too (attributed to its user
+ * space callchain) unless @param *user_only is set, or gets set because
+ * kernel.perf_event_paranoid does not allow it.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+static int open_thread(struct sampled_thread *t, pid_t tid, int *user_only)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = SAMPLE_FREQ;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.sample_max_stack = MAX_DEPTH;
+    attr.disabled = 1;
+    attr.exclude_kernel = *user_only;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+
+    int fd = perf_event_open(&attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && (errno == EACCES || errno == EPERM) && !*user_only) {
+        *user_only = 1;
+        attr.exclude_kernel = 1;
+        fd = perf_event_open(&attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (1 + RING_DATA_PAGES) * page;
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    t->tid = tid;
+    t->fd = fd;
+    t->meta = map;
+    t->map_len = len;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)tid);
+    FILE *fp = fopen(path, "r");
+    if (!fp || !fgets(t->comm, sizeof(t->comm), fp)) {
+        snprintf(t->comm, sizeof(t->comm), "%d", (int)tid);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    t->comm[strcspn(t->comm, "\n ;")] = '\0';
+
+    return 0;
+}
+
+/**
+ * Open sampling events for every thread of the process except the caller.
+ * Returns the number of threads being sampled.
+ */
+static unsigned int open_threads(struct profile *prof)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) {
+        syslog(LOG_ERR, "opendir(/proc/self/task) failed: %s", strerror(errno));
+        return 0;
+    }
+
+    pid_t self = syscall(SYS_gettid);
+    int reported = 0;
+    int user_only = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL && prof->nthreads < MAX_THREADS) {
+        pid_t tid = atoi(ent->d_name);
+        if (tid <= 0 || tid == self) {
+            continue;
+        }
+        if (open_thread(&prof->threads[prof->nthreads], tid, &user_only) == 0) {
+            prof->nthreads++;
+        } else if (!reported) {
+            // Typically EACCES: kernel.perf_event_paranoid too strict
+            syslog(LOG_ERR, "perf_event_open(tid %d) failed: %s", (int)tid, strerror(errno));
+            reported = 1;
+        }
+    }
+
+    closedir(dir);
+    if (user_only && prof->nthreads > 0) {
+        syslog(LOG_INFO, "Sampling user time only (kernel.perf_event_paranoid)");
+    }
+    return prof->nthreads;
+}
+
+static void close_threads(struct profile *prof)
+{
+    for (unsigned int i = 0; i < prof->nthreads; i++) {
+        munmap(prof->threads[i].meta, prof->threads[i].map_len);
+        close(prof->threads[i].fd);
+    }
+}
+
+static void add_stack(struct profile *prof, unsigned int thread,
+                      const uint64_t *ips, unsigned int depth)
+{
+    uint64_t hash = 1469598103934665603ull ^ thread;   // FNV-1a
+    for (unsigned int i = 0; i < depth; i++) {
+        hash = (hash ^ ips[i]) * 1099511628211ull;
+    }
+
+    for (unsigned int probe = 0; probe < STACK_SLOTS; probe++) {
+        struct stack *s = &prof->stacks[(hash + probe) & (STACK_SLOTS - 1)];
+        if (s->count == 0) {
+            if (prof->nstacks >= STACK_SLOTS * 3 / 4) {
+                break;
+            }
+            s->count = 1;
+            s->hash = hash;
+            s->thread = thread;
+            s->depth = depth;
+            memcpy(s->ips, ips, depth * sizeof(ips[0]));
+            prof->nstacks++;
+            return;
+        }
+        if (s->hash == hash && s->thread == thread && s->depth == depth &&
+            memcmp(s->ips, ips, depth * sizeof(ips[0])) == 0) {
+            s->count++;
+            return;
+        }
+    }
+    prof->dropped++;
+}
+
+/**
+ * Consume all records in the ring buffer of thread @param index.
+ */
+static void drain_thread(struct profile *prof, unsigned int index)
+{
+    struct sampled_thread *t = &prof->threads[index];
+    struct perf_event_mmap_page *meta = t->meta;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = RING_DATA_PAGES * page;
+    const unsigned char *data = (const unsigned char *)meta + page;
+
+    uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = meta->data_tail;
+
+    while (tail < head) {
+        // Records may wrap around the end of the ring: copy them out
+        union {
+            struct perf_event_header header;
+            unsigned char bytes[sizeof(struct perf_event_header) + 16 +
+                                (MAX_DEPTH + 8) * sizeof(uint64_t)];
+        } rec;
+
+        size_t off = tail & (size - 1);
+        for (size_t i = 0; i < sizeof(rec.header); i++) {
+            rec.bytes[i] = data[(off + i) & (size - 1)];
+        }
+        size_t len = rec.header.size;
+        if (len < sizeof(rec.header)) {
+            break;      // corrupt ring, give up on it
+        }
+        if (len > sizeof(rec.bytes)) {
+            tail += len;
+            prof->dropped++;
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) {
+            rec.bytes[i] = data[(off + i) & (size - 1)];
+        }
+        tail += len;
+
+        if (rec.header.type == PERF_RECORD_LOST) {
+            uint64_t lost;
+            memcpy(&lost, rec.bytes + sizeof(rec.header) + sizeof(uint64_t), sizeof(lost));
+            prof->dropped += lost;
+            continue;
+        }
+        if (rec.header.type != PERF_RECORD_SAMPLE) {
+            continue;
+        }
+
+        // Layout for PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN:
+        // u32 pid, tid; u64 nr; u64 ips[nr]
+        const unsigned char *p = rec.bytes + sizeof(rec.header) + 2 * sizeof(uint32_t);
+        uint64_t nr;
+        memcpy(&nr, p, sizeof(nr));
+        p += sizeof(nr);
+        if (sizeof(rec.header) + 2 * sizeof(uint32_t) + sizeof(nr) + nr * sizeof(uint64_t) > len) {
+            prof->dropped++;
+            continue;
+        }
+
+        uint64_t ips[MAX_DEPTH];
+        unsigned int depth = 0;
+        for (uint64_t i = 0; i < nr && depth < MAX_DEPTH; i++) {
+            uint64_t ip;
+            memcpy(&ip, p + i * sizeof(ip), sizeof(ip));
+            if (ip >= (uint64_t)PERF_CONTEXT_MAX) {
+                continue;   // PERF_CONTEXT_USER and friends
+            }
+            // Code built without frame pointers (libc, typically) sends the
+            // unwinder into the weeds: stop at the first address that is
+            // not inside any loaded module
+            Dl_info info;
+            if (dladdr((void *)(uintptr_t)ip, &info) == 0) {
+                break;
+            }
+            ips[depth++] = ip;
+        }
+        if (depth > 0) {
+            add_stack(prof, index, ips, depth);
+            prof->samples++;
+        }
+    }
+
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write a printable name for code address @param ip to @param out.
+ */
+static void format_frame(uint64_t ip, char *out, size_t cap)
+{
+    Dl_info info;
+    const ElfW(Sym) *sym = NULL;
+
+    if (dladdr1((void *)(uintptr_t)ip, &info, (void **)&sym, RTLD_DL_SYMENT) == 0) {
+        snprintf(out, cap, "[unknown+0x%llx]", (unsigned long long)ip);
+        return;
+    }
+
+    // dladdr() returns the closest dynamic symbol below ip even when ip is
+    // in a local function; only trust it when ip falls inside the symbol
+    uintptr_t saddr = (uintptr_t)info.dli_saddr;
+    if (info.dli_sname && sym && ip >= saddr && ip < saddr + sym->st_size) {
+        snprintf(out, cap, "%s", info.dli_sname);
+        return;
+    }
+
+    const char *module = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "unknown");
+    snprintf(out, cap, "%s+0x%llx", module,
+             (unsigned long long)(ip - (uintptr_t)info.dli_fbase));
+}
+
+/**
+ * Write the collected stacks in folded format, root frame first.
+ * Returns 0 on success, -1 on error.
+ */
+static int write_folded(struct profile *prof)
+{
+    size_t tmp_len = strlen(prof->output_path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path) {
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", prof->output_path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        syslog(LOG_ERR, "fopen(\"%s\") failed: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+
+    char frame[256];
+    for (unsigned int slot = 0; slot < STACK_SLOTS; slot++) {
+        struct stack *s = &prof->stacks[slot];
+        if (s->count == 0) {
+            continue;
+        }
+        fputs(prof->threads[s->thread].comm, fp);
+        for (unsigned int i = s->depth; i-- > 0;) {
+            // Return addresses point after the call; step back into it
+            format_frame(i == 0 ? s->ips[i] : s->ips[i] - 1, frame, sizeof(frame));
+            fputc(';', fp);
+            fputs(frame, fp);
+        }
+        fprintf(fp, " %lu\n", s->count);
+    }
+
+    int rc = 0;
+    if (fclose(fp) == EOF || rename(tmp_path, prof->output_path) == -1) {
+        syslog(LOG_ERR, "writing \"%s\" failed: %s", prof->output_path, strerror(errno));
+        remove(tmp_path);
+        rc = -1;
+    }
+
+    free(tmp_path);
+    return rc;
+}
+
+static void *profiler_thread(void *arg)
+{
+    struct profile *prof = arg;
+
+    if (open_threads(prof) == 0) {
+        syslog(LOG_ERR, "Profiling not started, no thread could be sampled");
+        goto out;
+    }
+
+    syslog(LOG_INFO, "Profiling %u threads for %u s", prof->nthreads, prof->seconds);
+    for (unsigned int i = 0; i < prof->nthreads; i++) {
+        ioctl(prof->threads[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += prof->seconds;
+
+    do {
+        struct timespec pause = { 0, DRAIN_INTERVAL_MS * 1000000L };
+        nanosleep(&pause, NULL);
+        for (unsigned int i = 0; i < prof->nthreads; i++) {
+            drain_thread(prof, i);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < deadline.tv_sec ||
+             (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+
+    for (unsigned int i = 0; i < prof->nthreads; i++) {
+        ioctl(prof->threads[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+        drain_thread(prof, i);
+    }
+
+    if (write_folded(prof) == 0) {
+        syslog(LOG_INFO, "Profile written to %s: %lu samples, %u stacks, %lu dropped",
+               prof->output_path, prof->samples, prof->nstacks, prof->dropped);
+    }
+
+out:
+    close_threads(prof);
+    free(prof->stacks);
+    free(prof->output_path);
+    free(prof);
+    atomic_store(&profiling, 0);
+    return NULL;
+}
+
+int selfprof_start(unsigned int seconds, const char *output_path)
+{
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&profiling, &expected, 1)) {
+        syslog(LOG_ERR, "Profiling already in progress");
+        return -1;
+    }
+
+    struct profile *prof = calloc(1, sizeof(*prof));
+    if (prof) {
+        prof->stacks = calloc(STACK_SLOTS, sizeof(*prof->stacks));
+        prof->output_path = strdup(output_path);
+    }
+    if (!prof || !prof->stacks || !prof->output_path) {
+        syslog(LOG_ERR, "Out of memory starting profiler");
+        if (prof) {
+            free(prof->stacks);
+            free(prof->output_path);
+            free(prof);
+        }
+        atomic_store(&profiling, 0);
+        return -1;
+    }
+    prof->seconds = seconds;
+
+    // The profiler must not take signals meant for the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thread, &attr, profiler_thread, prof);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "pthread_create() failed: %s", strerror(rc));
+        free(prof->stacks);
+        free(prof->output_path);
+        free(prof);
+        atomic_store(&profiling, 0);
+        return -1;
+    }
+
+    return 0;
+}
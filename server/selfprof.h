@@ -0,0 +1,26 @@
+/**
+ * selfprof.h
+ *
+ * On-demand sampling profiler for the threads of the calling process,
+ * built on perf_event_open(2) so that no perf binary is needed on the
+ * target.  The result is written as folded stacks ("frame;frame;... count"
+ * per line), the input format of flamegraph.pl and similar tools.
+ *
+ * Frames are symbolized with dladdr(); frames it cannot name are written
+ * as "module+0xoffset" so they can be resolved offline with addr2line
+ * against an unstripped copy of the binary.
+ */
+
+#ifndef SELFPROF_H
+#define SELFPROF_H
+
+/**
+ * Start profiling every thread of the process for @param seconds seconds
+ * in a background thread, writing the folded stacks to @param output_path
+ * when done.  Threads created after the start are not sampled.
+ * Returns 0 if profiling started, -1 if it could not be started or a
+ * profile is already being taken (errors are logged to syslog).
+ */
+int selfprof_start(unsigned int seconds, const char *output_path);
+
+#endif /* SELFPROF_H */
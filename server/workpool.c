@@ -0,0 +1,410 @@
+/**
+ * workpool.c
+ *
+ * Work-stealing thread pool, see workpool.h.
+ *
+ * The per-worker deques follow Chase and Lev, "Dynamic Circular Work-Stealing
+ * Deque" (SPAA 2005), with the C11 memory orderings of Le et al., "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ */
+
+#include "workpool.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define DEQUE_INITIAL_SIZE 64
+#define CACHE_LINE 64
+
+// Out of every LOW_PRIO_QUOTA tasks a worker runs, one is low priority if
+// any is available, so high priority load cannot starve low priority work.
+#define LOW_PRIO_QUOTA 8
+
+/**
+ * Circular task buffer of a deque.  Replaced buffers cannot be freed while
+ * thieves might still read from them, so they stay chained through @c prev
+ * until the pool is destroyed.
+ */
+struct wp_array {
+    struct wp_array *prev;
+    long size;                          // always a power of two
+    _Atomic(struct workpool_task *) buf[];
+};
+
+struct wp_deque {
+    _Alignas(CACHE_LINE) atomic_long top;       // stolen from by other workers
+    _Alignas(CACHE_LINE) atomic_long bottom;    // pushed/taken by the owner only
+    _Atomic(struct wp_array *) array;
+};
+
+struct wp_worker {
+    struct wp_deque deques[WORKPOOL_NPRIO];
+    struct workpool *pool;
+    pthread_t thread;
+    unsigned int rng;                   // victim selection
+    unsigned int high_run;              // high priority tasks run in a row
+};
+
+struct workpool {
+    unsigned int nworkers;
+    struct wp_worker *workers;
+
+    pthread_mutex_t lock;               // guards the injection queues and sleeping
+    pthread_cond_t wake;
+    struct workpool_task *inject_head[WORKPOOL_NPRIO];
+    struct workpool_task *inject_tail[WORKPOOL_NPRIO];
+    atomic_int idle;                    // workers sleeping (or about to) on wake
+    int stopping;
+    unsigned int nstarted;              // worker threads to join
+};
+
+static __thread struct wp_worker *current_worker = NULL;
+
+static struct wp_array *array_new(long size, struct wp_array *prev)
+{
+    struct wp_array *a = malloc(sizeof(*a) + size * sizeof(a->buf[0]));
+    if (!a) {
+        return NULL;
+    }
+    a->prev = prev;
+    a->size = size;
+    return a;
+}
+
+/**
+ * Owner only: push @param task at the bottom of @param d.
+ * Returns 0 on success, -1 if the deque had to grow and malloc failed.
+ */
+static int deque_push(struct wp_deque *d, struct workpool_task *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct wp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+    if (b - t > a->size - 1) {
+        struct wp_array *bigger = array_new(a->size * 2, a);
+        if (!bigger) {
+            return -1;
+        }
+        for (long i = t; i < b; i++) {
+            atomic_store_explicit(&bigger->buf[i & (bigger->size - 1)],
+                                  atomic_load_explicit(&a->buf[i & (a->size - 1)],
+                                                       memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+        atomic_store_explicit(&d->array, bigger, memory_order_release);
+        a = bigger;
+    }
+
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Owner only: take the most recently pushed task, or NULL if empty.
+ */
+static struct workpool_task *deque_take(struct wp_deque *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct wp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct workpool_task *task =
+        atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+    if (t == b) {
+        // Last element: race against thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Any thread: steal the oldest task of @param d.
+ * Returns NULL if the deque was empty or the steal lost a race; @param lost
+ * is set in the latter case so the caller may retry.
+ */
+static struct workpool_task *deque_steal(struct wp_deque *d, int *lost)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    *lost = 0;
+    if (t >= b) {
+        return NULL;
+    }
+
+    struct wp_array *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    struct workpool_task *task =
+        atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        *lost = 1;
+        return NULL;
+    }
+    return task;
+}
+
+static int deque_empty(struct wp_deque *d)
+{
+    long t = atomic_load(&d->top);
+    long b = atomic_load(&d->bottom);
+    return t >= b;
+}
+
+/**
+ * Caller holds pool->lock.  True if any task is queued anywhere.
+ */
+static int work_visible(struct workpool *pool)
+{
+    for (int prio = 0; prio < WORKPOOL_NPRIO; prio++) {
+        if (pool->inject_head[prio]) {
+            return 1;
+        }
+        for (unsigned int i = 0; i < pool->nworkers; i++) {
+            if (!deque_empty(&pool->workers[i].deques[prio])) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static struct workpool_task *inject_pop(struct workpool *pool, int prio)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct workpool_task *task = pool->inject_head[prio];
+    if (task) {
+        pool->inject_head[prio] = task->next;
+        if (!pool->inject_head[prio]) {
+            pool->inject_tail[prio] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return task;
+}
+
+static struct workpool_task *steal_any(struct wp_worker *self, int prio)
+{
+    struct workpool *pool = self->pool;
+    unsigned int n = pool->nworkers;
+
+    self->rng = self->rng * 1103515245u + 12345u;
+    unsigned int start = (self->rng >> 16) % n;
+
+    for (unsigned int k = 0; k < n; k++) {
+        struct wp_worker *victim = &pool->workers[(start + k) % n];
+        if (victim == self) {
+            continue;
+        }
+        int lost;
+        do {
+            struct workpool_task *task = deque_steal(&victim->deques[prio], &lost);
+            if (task) {
+                return task;
+            }
+        } while (lost);
+    }
+    return NULL;
+}
+
+/**
+ * Look for a task of priority @param prio: own deque first, then the
+ * injection queue, then the other workers' deques.
+ */
+static struct workpool_task *find_task(struct wp_worker *self, int prio)
+{
+    struct workpool_task *task = deque_take(&self->deques[prio]);
+    if (!task) {
+        task = inject_pop(self->pool, prio);
+    }
+    if (!task) {
+        task = steal_any(self, prio);
+    }
+    return task;
+}
+
+static void *worker_main(void *arg)
+{
+    struct wp_worker *self = arg;
+    struct workpool *pool = self->pool;
+
+    current_worker = self;
+
+    for (;;) {
+        struct workpool_task *task = NULL;
+        if (self->high_run >= LOW_PRIO_QUOTA) {
+            task = find_task(self, WORKPOOL_PRIO_LOW);
+            self->high_run = 0;
+        }
+        if (!task) {
+            for (int prio = 0; prio < WORKPOOL_NPRIO && !task; prio++) {
+                task = find_task(self, prio);
+            }
+        }
+        if (task) {
+            if (task->priority == WORKPOOL_PRIO_HIGH) {
+                self->high_run++;
+            } else {
+                self->high_run = 0;
+            }
+            task->fn(task);
+            continue;
+        }
+
+        // Nothing to do: sleep until a submitter wakes us up
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->idle, 1);
+        while (!work_visible(pool) && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        int done = pool->stopping && !work_visible(pool);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done) {
+            break;
+        }
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+struct workpool *workpool_create(unsigned int nworkers)
+{
+    if (nworkers == 0) {
+        nworkers = 1;
+    }
+
+    struct workpool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->workers = aligned_alloc(CACHE_LINE,
+                                  ((nworkers * sizeof(struct wp_worker) + CACHE_LINE - 1)
+                                   / CACHE_LINE) * CACHE_LINE);
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    atomic_init(&pool->idle, 0);
+
+    // Set up every deque before any worker starts looking at them
+    for (unsigned int i = 0; i < nworkers; i++) {
+        struct wp_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->rng = i + 1;
+        w->high_run = 0;
+        pool->nworkers++;
+        for (int prio = 0; prio < WORKPOOL_NPRIO; prio++) {
+            struct wp_deque *d = &w->deques[prio];
+            atomic_init(&d->top, 0);
+            atomic_init(&d->bottom, 0);
+            atomic_init(&d->array, array_new(DEQUE_INITIAL_SIZE, NULL));
+        }
+        for (int prio = 0; prio < WORKPOOL_NPRIO; prio++) {
+            if (!atomic_load(&w->deques[prio].array)) {
+                workpool_destroy(pool);
+                return NULL;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                           &pool->workers[i]) != 0) {
+            workpool_destroy(pool);
+            return NULL;
+        }
+        pool->nstarted++;
+    }
+
+    return pool;
+}
+
+int workpool_submit(struct workpool *pool, struct workpool_task *task)
+{
+    int prio = task->priority;
+
+    if (current_worker && current_worker->pool == pool) {
+        if (deque_push(&current_worker->deques[prio], task) != 0) {
+            return -1;
+        }
+    } else {
+        task->next = NULL;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->inject_tail[prio]) {
+            pool->inject_tail[prio]->next = task;
+        } else {
+            pool->inject_head[prio] = task;
+        }
+        pool->inject_tail[prio] = task;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    // Pairs with the idle increment in worker_main(): either the sleeper
+    // sees the new task, or we see the sleeper and wake it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
+
+void workpool_destroy(struct workpool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->nstarted; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (unsigned int i = 0; i < pool->nworkers; i++) {
+        for (int prio = 0; prio < WORKPOOL_NPRIO; prio++) {
+            struct wp_array *a = atomic_load(&pool->workers[i].deques[prio].array);
+            while (a) {
+                struct wp_array *prev = a->prev;
+                free(a);
+                a = prev;
+            }
+        }
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
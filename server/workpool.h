@@ -0,0 +1,60 @@
+/**
+ * workpool.h
+ *
+ * Work-stealing thread pool used by aesdsocket to run connection tasks.
+ *
+ * Every worker owns a Chase-Lev deque.  Tasks submitted from a worker are
+ * pushed on that worker's own deque (LIFO for the owner), tasks submitted
+ * from any other thread go through a shared injection queue.  An idle
+ * worker steals from the top of the other workers' deques, so one worker
+ * stuck in an expensive task does not delay the work queued behind it.
+ *
+ * Each worker keeps one deque per priority level and the injection queue
+ * is split the same way.  Workers look for high priority work first,
+ * everywhere, before taking low priority work; a small quota of low
+ * priority tasks still runs under sustained high priority load.
+ */
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+struct workpool;
+
+enum workpool_priority {
+    WORKPOOL_PRIO_HIGH,
+    WORKPOOL_PRIO_LOW,
+    WORKPOOL_NPRIO
+};
+
+/**
+ * Intrusive task descriptor.  The pool never allocates or frees tasks;
+ * embed this structure in the object the task works on and recover it in
+ * @c fn with offsetof().  A task may be queued at most once at a time.
+ */
+struct workpool_task {
+    void (*fn)(struct workpool_task *task);
+    enum workpool_priority priority;    // read by workpool_submit()
+    struct workpool_task *next;         // injection queue link, owned by the pool
+};
+
+/**
+ * Create a pool with @param nworkers worker threads (at least 1).
+ * Returns NULL on error.
+ */
+struct workpool *workpool_create(unsigned int nworkers);
+
+/**
+ * Queue @param task for execution on one of the pool's workers, at the
+ * priority set in task->priority.
+ * Safe to call from any thread, including from inside a running task.
+ * Returns 0 on success, -1 on error (out of memory while growing a deque).
+ */
+int workpool_submit(struct workpool *pool, struct workpool_task *task);
+
+/**
+ * Run every task still queued, stop and join all workers and free the pool.
+ * Tasks submitted while the pool drains are still executed.
+ */
+void workpool_destroy(struct workpool *pool);
+
+#endif /* WORKPOOL_H */
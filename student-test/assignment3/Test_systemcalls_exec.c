@@ -0,0 +1,221 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/**
+ * Unit tests of the process helpers in examples/systemcalls/systemcalls.c.
+ * Run from the repository root; the fork server test needs
+ * examples/systemcalls/exec-server-helper, built with make in that directory.
+ */
+
+#define PIPELINE_OUTPUT "/tmp/Test_systemcalls_pipeline.txt"
+#define TIMEOUT_PIDFILE "/tmp/Test_systemcalls_timeout.pid"
+#define SERVER_HELPER "examples/systemcalls/" EXEC_SERVER_HELPER
+#define SERVER_CALLERS 6
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void test_exec_pipeline_statuses()
+{
+    char *const echo[] = { "/bin/echo", "hello", NULL };
+    // Reads all its input, so the echo never gets SIGPIPE
+    char *const fail[] = { "/bin/sh", "-c", "cat; exit 3", NULL };
+    char *const cat[] = { "/bin/cat", NULL };
+    char *const *const argvs[] = { echo, fail, cat };
+    int statuses[3] = { -2, -2, -2 };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_pipeline(argvs, 3, PIPELINE_OUTPUT, statuses),
+                              "A pipeline with a failing stage must fail");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, statuses[0], "Status of the first stage");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, statuses[1], "Status of the failing stage");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, statuses[2], "Status of the last stage");
+
+    char buf[32] = "";
+    FILE *f = fopen(PIPELINE_OUTPUT, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(f, "Pipeline output file not created");
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    remove(PIPELINE_OUTPUT);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("hello\n", buf, "Output of the last stage");
+}
+
+struct capture_totals {
+    size_t out;
+    size_t err;
+};
+
+static void count_output(int fd, const char *data, size_t len, void *arg)
+{
+    struct capture_totals *totals = arg;
+    (void)data;
+    if (fd == STDOUT_FILENO) {
+        totals->out += len;
+    } else {
+        totals->err += len;
+    }
+}
+
+void test_exec_capture_truncation_interleaved()
+{
+    // 100 lines on each stream, alternating: 10 * 5 + 90 * 6 = 590 bytes each
+    char *const argv[] = { "/bin/sh", "-c",
+                           "i=0; while [ $i -lt 100 ]; do echo out$i; echo err$i >&2; "
+                           "i=$((i + 1)); done", NULL };
+    struct exec_capture capture;
+    struct capture_totals totals = { 0, 0 };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(argv, 64, count_output, &totals, &capture),
+                             "Command writing to both streams must succeed");
+    TEST_ASSERT_TRUE_MESSAGE(capture.truncated, "Output beyond 64 bytes must be dropped");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(64, capture.out_len, "Kept stdout bytes");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(64, capture.err_len, "Kept stderr bytes");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp(capture.out, "out0\nout1\nout2\n", 15),
+                                  "Start of stdout");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, strncmp(capture.err, "err0\nerr1\nerr2\n", 15),
+                                  "Start of stderr");
+    TEST_ASSERT_NULL_MESSAGE(memchr(capture.out, 'e', capture.out_len),
+                             "stderr bytes in stdout");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(590, totals.out, "stdout bytes passed to the callback");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(590, totals.err, "stderr bytes passed to the callback");
+    exec_capture_free(&capture);
+}
+
+void test_exec_batch_spawn_failure()
+{
+    char *const ok[] = { "/bin/true", NULL };
+    char *const missing[] = { "/nonexistent/Test_systemcalls_exec", NULL };
+    char *const fail[] = { "/bin/sh", "-c", "exit 2", NULL };
+    struct exec_batch_item items[] = {
+        { .argv = ok }, { .argv = missing }, { .argv = fail },
+    };
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, do_exec_batch(items, 3, 2),
+                                  "Only one command of the batch succeeds");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, items[0].status, "Status of a successful command");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, items[1].status, "Status of a command not spawned");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, items[2].status, "Status of a failing command");
+}
+
+/**
+ * @return true if process @param pid is gone or a zombie.
+ */
+static bool process_dead(pid_t pid)
+{
+    char path[64];
+    char state = 'Z';
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return true;
+    }
+    int n = fscanf(f, "%*d (%*[^)]) %c", &state);
+    fclose(f);
+    return n != 1 || state == 'Z' || state == 'X';
+}
+
+void test_exec_timeout_kills_grandchildren()
+{
+    char *const argv[] = { "/bin/sh", "-c",
+                           "sleep 30 & echo $! > " TIMEOUT_PIDFILE "; wait", NULL };
+    struct exec_result result;
+    long long start_ms = monotonic_ms();
+
+    TEST_ASSERT_FALSE_MESSAGE(do_execv_timeout(300, &result, argv),
+                              "A command killed for its timeout must fail");
+    TEST_ASSERT_TRUE_MESSAGE(result.timed_out, "The command must be reported as timed out");
+    TEST_ASSERT_TRUE_MESSAGE(monotonic_ms() - start_ms < 5000,
+                             "The command must not run to completion");
+
+    int pid = 0;
+    FILE *f = fopen(TIMEOUT_PIDFILE, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(f, "The command did not start its background job");
+    int n = fscanf(f, "%d", &pid);
+    fclose(f);
+    remove(TIMEOUT_PIDFILE);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, n, "No pid of the background job");
+
+    // SIGKILL takes effect asynchronously
+    bool dead = false;
+    for (int i = 0; i < 100 && !(dead = process_dead(pid)); i++) {
+        usleep(10000);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(dead, "The background job of the command was not killed");
+}
+
+struct server_caller {
+    struct exec_server *server;
+    int index;
+    int status;
+};
+
+static void *server_caller_main(void *arg)
+{
+    struct server_caller *caller = arg;
+    char script[64];
+    // Later callers finish first, so replies arrive out of request order
+    snprintf(script, sizeof(script), "sleep 0.%d; exit %d", SERVER_CALLERS - caller->index,
+             caller->index + 10);
+    char *const argv[] = { "/bin/sh", "-c", script, NULL };
+    caller->status = exec_server_run(caller->server, argv, -1, -1, -1);
+    return NULL;
+}
+
+void test_exec_server_concurrent_callers()
+{
+    if (access(SERVER_HELPER, X_OK) != 0) {
+        TEST_IGNORE_MESSAGE("Build " SERVER_HELPER " and run from the repository root");
+    }
+    struct exec_server server;
+    TEST_ASSERT_TRUE_MESSAGE(exec_server_start(&server, SERVER_HELPER),
+                             "Cannot start the fork server");
+
+    struct server_caller callers[SERVER_CALLERS];
+    pthread_t threads[SERVER_CALLERS];
+    int started = 0;
+    for (; started < SERVER_CALLERS; started++) {
+        callers[started].server = &server;
+        callers[started].index = started;
+        callers[started].status = -2;
+        if (pthread_create(&threads[started], NULL, server_caller_main,
+                           &callers[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    exec_server_stop(&server);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(SERVER_CALLERS, started, "pthread_create failed");
+    for (int i = 0; i < SERVER_CALLERS; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i + 10, callers[i].status,
+                                      "A caller got the status of another command");
+    }
+}
+
+void test_do_system_shell_fallbacks()
+{
+    // Plain words run without the shell
+    TEST_ASSERT_TRUE_MESSAGE(do_system("/bin/true"), "Direct command");
+    TEST_ASSERT_FALSE_MESSAGE(do_system("false"), "Failing command from the PATH");
+    // Builtins and shell syntax need /bin/sh
+    TEST_ASSERT_TRUE_MESSAGE(do_system("cd /"), "Shell builtin");
+    TEST_ASSERT_FALSE_MESSAGE(do_system("cd /nonexistent/Test_systemcalls_exec 2>/dev/null"),
+                              "Failing shell builtin");
+    TEST_ASSERT_TRUE_MESSAGE(do_system("echo hello | grep -q hello"), "Pipe");
+    TEST_ASSERT_TRUE_MESSAGE(do_system("x=1; test $x = 1"), "Variables");
+    TEST_ASSERT_FALSE_MESSAGE(do_system("true && exit 4"), "Exit status through the shell");
+    TEST_ASSERT_TRUE_MESSAGE(do_system("test \"a b\" = 'a b'"), "Quotes");
+}
@@ -0,0 +1,264 @@
+#include "unity.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/**
+ * Exercise the replay cursor protocol of server/aesdsocket: handshake
+ * reply, acknowledgements, and positions that do not belong to the data
+ * file (another generation, or records it does not have).
+ * The tests start their own server, so run them from the repository root
+ * with no aesdsocket running.
+ */
+
+#define SERVER_PATH "server/aesdsocket"
+#define SERVER_PORT 9000
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define CURSOR_FILE "/var/tmp/aesdsocketcursors"
+#define CLIENT_HELLO "AESD_CLIENT:unity-cursor"
+
+static pid_t server_pid = -1;
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct timeval timeout = { .tv_sec = 2 };
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Start the server and wait until it accepts connections.
+ * Returns true on success.
+ */
+static bool start_server(void)
+{
+    server_pid = fork();
+    if (server_pid == 0) {
+        execl(SERVER_PATH, SERVER_PATH, (char *)NULL);
+        _exit(127);
+    }
+    if (server_pid == -1) {
+        return false;
+    }
+    for (int i = 0; i < 50; i++) {
+        int fd = connect_server();
+        if (fd != -1) {
+            close(fd);
+            return true;
+        }
+        usleep(20000);
+    }
+    return false;
+}
+
+/**
+ * Stop the server started by start_server(), which removes the data file.
+ */
+static void stop_server(void)
+{
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+    }
+    server_pid = -1;
+}
+
+static bool send_str(int fd, const char *str)
+{
+    size_t len = strlen(str);
+    return send(fd, str, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/**
+ * Receive exactly @param len bytes into @param buf (NUL terminated).
+ */
+static bool recv_exact(int fd, char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = recv(fd, buf + got, len - got, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        got += r;
+    }
+    buf[got] = '\0';
+    return true;
+}
+
+/**
+ * Receive one line, without its '\n', into @param buf of @param cap bytes.
+ */
+static bool recv_line(int fd, char *buf, size_t cap)
+{
+    for (size_t i = 0; i + 1 < cap; i++) {
+        if (!recv_exact(fd, buf + i, 1)) {
+            return false;
+        }
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Identify as the test client with @param hello (CLIENT_HELLO plus
+ * options), read the handshake reply into @param generation and
+ * @param seq, then the @param replay expected after it.
+ * Returns the connection, or -1 if the server answered anything else.
+ */
+static int handshake(const char *hello, unsigned long long *generation, unsigned long *seq,
+                     const char *replay)
+{
+    char line[128];
+    char buf[256];
+    int fd = connect_server();
+    if (fd == -1) {
+        return -1;
+    }
+    snprintf(line, sizeof(line), "%s\n", hello);
+    if (!send_str(fd, line) || !recv_line(fd, line, sizeof(line)) ||
+        sscanf(line, "AESD_CURSOR:%llu:%lu", generation, seq) != 2 ||
+        !recv_exact(fd, buf, strlen(replay)) || strcmp(buf, replay) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Acknowledge record @param ack of @param generation on a connection that
+ * is replayed @param before, then return the cursor position of the next
+ * handshake in @param seq and check it is replayed @param after.
+ */
+static bool ack_and_reconnect(unsigned long long generation, unsigned long ack,
+                              const char *before, unsigned long *seq, const char *after)
+{
+    char line[128];
+    unsigned long long gen, current;
+    unsigned long first;
+    int fd = handshake(CLIENT_HELLO, &current, &first, before);
+    if (fd == -1) {
+        return false;
+    }
+    // Acknowledgements are not answered, the handshake below comes after it
+    snprintf(line, sizeof(line), "AESD_ACK:%llu:%lu\n", generation, ack);
+    bool ok = send_str(fd, line);
+    close(fd);
+    usleep(100000);
+
+    fd = handshake(CLIENT_HELLO, &gen, seq, after);
+    if (fd == -1) {
+        return false;
+    }
+    close(fd);
+    return ok && gen == current;
+}
+
+void test_aesdsocket_cursor_protocol()
+{
+    if (access(SERVER_PATH, X_OK) != 0) {
+        TEST_IGNORE_MESSAGE("Build " SERVER_PATH " and run from the repository root");
+    }
+    remove(DATA_FILE);
+    remove(CURSOR_FILE);
+
+    const char *failure = NULL;
+    unsigned long long generation, new_generation;
+    unsigned long seq;
+    char buf[64];
+    int fd;
+
+    if (!start_server()) {
+        failure = "Server did not start";
+        goto out;
+    }
+
+    // Two records from an anonymous client
+    fd = connect_server();
+    bool stored = fd != -1 && send_str(fd, "one\ntwo\n") &&
+                  recv_exact(fd, buf, strlen("one\none\ntwo\n"));
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!stored) {
+        failure = "Records not stored";
+        goto out;
+    }
+
+    // A new client gets everything
+    fd = handshake(CLIENT_HELLO, &generation, &seq, "one\ntwo\n");
+    if (fd == -1 || seq != 0) {
+        failure = "Handshake of a new client did not replay the whole file";
+        goto out;
+    }
+    close(fd);
+
+    // After acknowledging the first record only the second is replayed
+    if (!ack_and_reconnect(generation, 1, "one\ntwo\n", &seq, "two\n") || seq != 1) {
+        failure = "Acknowledged record replayed again";
+        goto out;
+    }
+
+    // Positions of another generation, or past the end of the file, are ignored
+    if (!ack_and_reconnect(generation + 1, 2, "two\n", &seq, "two\n") || seq != 1) {
+        failure = "Acknowledgement of another generation moved the cursor";
+        goto out;
+    }
+    if (!ack_and_reconnect(generation, 5, "two\n", &seq, "two\n") || seq != 1) {
+        failure = "Acknowledgement of missing records moved the cursor";
+        goto out;
+    }
+
+    // The data file starts over on restart: old positions mean nothing
+    stop_server();
+    if (!start_server()) {
+        failure = "Server did not restart";
+        goto out;
+    }
+    fd = connect_server();
+    stored = fd != -1 && send_str(fd, "three\n") && recv_exact(fd, buf, strlen("three\n"));
+    if (fd != -1) {
+        close(fd);
+    }
+    snprintf(buf, sizeof(buf), CLIENT_HELLO " %llu:2", generation);
+    fd = stored ? handshake(buf, &new_generation, &seq, "three\n") : -1;
+    if (fd == -1 || new_generation == generation || seq != 0) {
+        failure = "Position of the previous data file accepted after restart";
+        goto out;
+    }
+    close(fd);
+
+out:
+    stop_server();
+    remove(CURSOR_FILE);
+    TEST_ASSERT_MESSAGE(failure == NULL, failure);
+}